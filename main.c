@@ -1,5 +1,23 @@
+#include <string.h>
+
+#include "src/crc32c.h"
 #include "src/fs.h"
 
+// counts the valid inodes handed out by for_each_inode, possibly from several threads.
+static bool count_valid_inodes(const InodeBatch *batch, void *arg) {
+    for (size_t i = 0; i < batch->count; i++) {
+        if (batch->inodes[i].valid) {
+            __atomic_add_fetch((size_t*)arg, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return true;
+}
+
+static bool stop_inode_scan(const InodeBatch *batch, void *arg) {
+    return false;
+}
+
 int main(int agrc, char **argv) {
     // just for testing purposes
     const char *tmp_disk_path = "./disk";
@@ -63,7 +81,7 @@ int main(int agrc, char **argv) {
 
     // aserrt all data blocks are unused since its the first time mount
     for (int i = 0; i < NUMBER_OF_DATA_BLOCKS(block.super.nblocks); i++) {
-        assert(fs->free_blocks[i]);
+        assert(!fs->block_refs[i]);
     }
 
     // try format a formatted disk
@@ -72,9 +90,364 @@ int main(int agrc, char **argv) {
     // create inode (should return the first inode#0)
     assert(create_inode(fs) == 0);
 
+    // assert hot path counters are collected
+    char msg[] = "hello simplefs";
+    char msg_buff[sizeof(msg)];
+    assert(write_to_inode(fs, 0, msg, sizeof(msg), 0) == sizeof(msg));
+    assert(read_from_inode(fs, 0, msg_buff, sizeof(msg), 0) == sizeof(msg));
+    assert(memcmp(msg, msg_buff, sizeof(msg)) == 0);
+
+    FsStats stats;
+    fs_get_stats(fs, &stats);
+    assert(stats.fs.ops == 3);
+    assert(stats.fs.block_allocs == 1);
+    // a partial write to a new block needs no read of its previous content
+    assert(stats.fs.rmw_writes == 0);
+    assert(stats.io.reads > 0);
+    assert(stats.io.read_latency.count == stats.io.reads);
+    assert(stats.io.write_latency.count == stats.io.writes);
+
+    // assert inode 0 can't be created twice and its first block is mapped
+    uint32_t mapped[4];
+    assert(!create_inode_at(fs, 0));
+    assert(map_inode_blocks(fs, 0, 0, 2, mapped) == 2);
+    assert(mapped[0] >= DATA_FIRST_BLOCK(nblocks) && mapped[1] == 0);
+
+    // assert overwriting an allocated block keeps it in place
+    msg[0] = 'H';
+    assert(write_to_inode(fs, 0, msg, sizeof(msg), 0) == sizeof(msg));
+    assert(read_from_inode(fs, 0, msg_buff, sizeof(msg), 0) == sizeof(msg));
+    assert(memcmp(msg, msg_buff, sizeof(msg)) == 0);
+    assert(map_inode_blocks(fs, 0, 0, 1, &mapped[1]) == 1 && mapped[1] == mapped[0]);
+
+    // assert a snapshot shares inode 0's block until it is overwritten
+    int first_data_block = DATA_FIRST_BLOCK(nblocks);
+    ssize_t snap = snapshot_create(fs);
+    assert(snap == 0);
+    assert(fs->block_refs[mapped[0] - first_data_block] == 2);
+
+    assert(write_to_inode(fs, 0, "HELLO", 5, 0) == 5);
+    assert(fs->block_refs[mapped[0] - first_data_block] == 1);
+    assert(read_from_inode(fs, 0, msg_buff, sizeof(msg), 0) == sizeof(msg));
+    assert(memcmp("HELLO simplefs", msg_buff, sizeof(msg)) == 0);
+    assert(read_from_snapshot(fs, snap, 0, msg_buff, sizeof(msg), 0) == sizeof(msg));
+    assert(memcmp(msg, msg_buff, sizeof(msg)) == 0);
+
+    // assert a clone is copied on write as well
+    ssize_t clone = clone_inode(fs, 0);
+    assert(clone == 1);
+    assert(write_to_inode(fs, clone, "J", 1, 0) == 1);
+    assert(read_from_inode(fs, clone, msg_buff, sizeof(msg), 0) == sizeof(msg));
+    assert(memcmp("JELLO simplefs", msg_buff, sizeof(msg)) == 0);
+    assert(read_from_inode(fs, 0, msg_buff, sizeof(msg), 0) == sizeof(msg));
+    assert(memcmp("HELLO simplefs", msg_buff, sizeof(msg)) == 0);
+
+    // assert vectored writes and reads gather and scatter the buffers in order
+    struct iovec wv[2] = {{"AB", 2}, {"CD", 2}};
+    assert(writev_inode(fs, 0, wv, 2, 0) == 4);
+    char head[3], tail[11];
+    struct iovec rv[2] = {{head, sizeof(head)}, {tail, sizeof(tail)}};
+    assert(readv_inode(fs, 0, rv, 2, 0) == 14);
+    assert(memcmp(head, "ABC", 3) == 0 && memcmp(tail, "DO simplefs", 11) == 0);
+
+    // assert a batch sees its own writes and loads the inode block both inodes share once
+    char b0[5], b1[5];
+    struct iovec zv = {"Z", 1}, r0 = {b0, sizeof(b0)}, r1 = {b1, sizeof(b1)};
+    FsOp ops[3] = {
+        { .type = FS_OP_WRITE, .inode_num = clone, .iov = &zv, .iovcnt = 1, .offset = 0 },
+        { .type = FS_OP_READ, .inode_num = 0, .iov = &r0, .iovcnt = 1, .offset = 0 },
+        { .type = FS_OP_READ, .inode_num = clone, .iov = &r1, .iovcnt = 1, .offset = 0 },
+    };
+    fs_get_stats(fs, &stats);
+    uint64_t inode_loads = stats.fs.inode_loads;
+    assert(fs_submit(fs, ops, 3));
+    assert(ops[0].result == 1 && ops[1].result == 5 && ops[2].result == 5);
+    assert(memcmp(b0, "ABCDO", 5) == 0 && memcmp(b1, "ZELLO", 5) == 0);
+    fs_get_stats(fs, &stats);
+    assert(stats.fs.inode_loads == inode_loads + 1);
+
+    // assert writing a new block reads nothing but the inode block, which is saved without reloading it
+    fs_get_stats(fs, &stats);
+    uint64_t reads = stats.io.reads;
+    assert(write_to_inode(fs, clone, "0123456789", 10, BLOCK_SIZE) == 10);
+    fs_get_stats(fs, &stats);
+    assert(stats.io.reads == reads + 1);
+
+    // assert remounting rebuilds the same reference counts from inodes and snapshots
+    uint16_t refs[NUMBER_OF_DATA_BLOCKS(nblocks)];
+    memcpy(refs, fs->block_refs, sizeof(refs));
+    unmount(disk);
+    free_fs(fs);
+    fs = mount_fs(disk);
+    assert(fs != NULL);
+    assert(memcmp(refs, fs->block_refs, sizeof(refs)) == 0);
+
+    // assert deleting the snapshot frees the blocks only it referenced
+    assert(snapshot_delete(fs, snap));
+    assert(fs->block_refs[mapped[0] - first_data_block] == 0);
+    assert(read_from_snapshot(fs, snap, 0, msg_buff, sizeof(msg), 0) == -1);
+
+    // assert crc32c matches the standard check value
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+
+    // assert a corrupted inode block is detected when loading an inode and mounting
+    union Block saved;
+    assert(read_from_disk(disk, INODES_FIRST_BLOCK, saved.data));
+    block = saved;
+    block.inodes[0].size ^= 1;
+    assert(write_to_disk(disk, INODES_FIRST_BLOCK, block.data));
+    assert(stat_inode(fs, 0) == -1);
+    fs_get_stats(fs, &stats);
+    assert(stats.fs.checksum_errors == 1);
+    unmount(disk);
+    assert(mount_fs(disk) == NULL);
+
+    // assert a checksummed but out of range block pointer is rejected on mount
+    block = saved;
+    block.inodes[0].direct[1] = nblocks;
+    block_seal(&block);
+    assert(write_to_disk(disk, INODES_FIRST_BLOCK, block.data));
+    assert(mount_fs(disk) == NULL);
+
+    assert(write_to_disk(disk, INODES_FIRST_BLOCK, saved.data));
+    free_fs(fs);
+    fs = mount_fs(disk);
+    assert(fs != NULL);
+
     // cleanup
+    free_fs(fs);
     close_disk(disk);
     remove(tmp_disk_path);
 
+    // assert an O_DIRECT disk round-trips unaligned buffers through its aligned buffer pool
+    DiskOptions opts = {.direct = true, .hugepages = true, .pool_blocks = 2};
+    disk = open_disk_with(tmp_disk_path, nblocks, &opts);
+    assert(disk != NULL);
+
+    char *aligned = disk_buffer_get(disk);
+    assert(((uintptr_t)aligned % BUFPOOL_ALIGN) == 0);
+
+    char *unaligned = (char*)malloc(BLOCK_SIZE + 1) + 1;
+    memset(unaligned, 'd', BLOCK_SIZE);
+    assert(write_to_disk(disk, 1, unaligned));
+    assert(read_from_disk(disk, 1, aligned));
+    assert(memcmp(aligned, unaligned, BLOCK_SIZE) == 0);
+    if (disk->direct) {
+        assert(disk->stats.bounces == 1);
+    }
+
+    // assert the pool hands out heap buffers once it runs dry
+    char *extra[2] = {disk_buffer_get(disk), disk_buffer_get(disk)};
+    assert(disk->pool->overflows == 1);
+    disk_buffer_put(disk, extra[0]);
+    disk_buffer_put(disk, extra[1]);
+    disk_buffer_put(disk, aligned);
+    free(unaligned - 1);
+
+    close_disk(disk);
+    remove(tmp_disk_path);
+
+    // assert blocks of a striped disk are placed round robin in stripes of stripe_blocks blocks
+    const char *members[] = {"./disk.0", "./disk.1", "./disk.2"};
+    DiskOptions striped = {.stripe_blocks = 2};
+    disk = open_striped_disk(members, 3, 30, &striped);
+    assert(disk != NULL);
+    assert(disk->nmembers == 3);
+
+    // assert zeroed options get the default buffer pool
+    assert(disk->pool->nbuffs == DEFAULT_POOL_BLOCKS);
+
+    stat(members[2], &st);
+    assert(st.st_size == 11 * BLOCK_SIZE);
+
+    // block 7 is in stripe 3, the second stripe of the first member, past its stripe header
+    memset(data, 's', BLOCK_SIZE);
+    assert(write_to_disk(disk, 7, data));
+    int member_fd = open(members[0], O_RDONLY);
+    assert(pread(member_fd, buff, BLOCK_SIZE, 4 * BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(buff, data, BLOCK_SIZE) == 0);
+    close(member_fd);
+    assert(!read_from_disk(disk, 30, buff));
+
+    // assert a multi block write spanning all members reads back and survives a remount
+    assert(format(disk));
+    fs = mount_fs(disk);
+    assert(fs != NULL);
+    assert(create_inode(fs) == 0);
+
+    char *striped_data = (char*)malloc(POINTERS_PER_INODE * BLOCK_SIZE);
+    char *striped_buff = (char*)malloc(POINTERS_PER_INODE * BLOCK_SIZE);
+    for (int i = 0; i < POINTERS_PER_INODE * BLOCK_SIZE; i++) {
+        striped_data[i] = 'a' + i / BLOCK_SIZE;
+    }
+
+    assert(write_to_inode(fs, 0, striped_data, POINTERS_PER_INODE * BLOCK_SIZE, 0) == POINTERS_PER_INODE * BLOCK_SIZE);
+    free_fs(fs);
+    fs = mount_fs(disk);
+    assert(fs != NULL);
+    assert(read_from_inode(fs, 0, striped_buff, POINTERS_PER_INODE * BLOCK_SIZE, 0) == POINTERS_PER_INODE * BLOCK_SIZE);
+    assert(memcmp(striped_buff, striped_data, POINTERS_PER_INODE * BLOCK_SIZE) == 0);
+    assert(sync_disk(disk));
+
+    // assert bulk_stat and for_each_inode match stat_inode while reading every inode block once,
+    // with the reads of every scan thread counted
+    assert(create_inode(fs) == 1);
+    assert(create_inode(fs) == 2);
+    assert(write_to_inode(fs, 2, striped_data, 10, 0) == 10);
+
+    ssize_t sizes[4];
+    fs_get_stats(fs, &stats);
+    inode_loads = stats.fs.inode_loads;
+    reads = stats.io.reads;
+    assert(bulk_stat(fs, 0, 4, sizes) == 4);
+    for (int i = 0; i < 3; i++) {
+        assert(sizes[i] == stat_inode(fs, i));
+    }
+    assert(sizes[3] == -1);
+    assert(bulk_stat(fs, fs->super.inodes_count - 1, 4, sizes) == 1);
+    assert(bulk_stat(fs, fs->super.inodes_count, 1, sizes) == -1);
+
+    size_t valid = 0;
+    assert(for_each_inode(fs, count_valid_inodes, &valid, 3));
+    assert(valid == 3);
+    assert(!for_each_inode(fs, stop_inode_scan, NULL, 2));
+
+    fs_get_stats(fs, &stats);
+    assert(stats.fs.inode_loads == inode_loads + 3);
+    assert(stats.fs.inode_scan_blocks >= 2 + fs->super.inblocks);
+    assert(stats.io.reads - reads >= stats.fs.inode_scan_blocks);
+
+    // assert sizes are byte accurate and holes read as zeros
+    assert(stat_inode(fs, 2) == 10);
+    assert(write_to_inode(fs, 2, "X", 1, 3 * BLOCK_SIZE) == 1);
+    assert(stat_inode(fs, 2) == 3 * BLOCK_SIZE + 1);
+    assert(map_inode_blocks(fs, 2, 1, 2, mapped) == 2 && mapped[0] == 0 && mapped[1] == 0);
+    memset(striped_buff, 'z', 3 * BLOCK_SIZE + 1);
+    assert(read_from_inode(fs, 2, striped_buff, 4 * BLOCK_SIZE, 0) == 3 * BLOCK_SIZE + 1);
+    assert(memcmp(striped_buff, striped_data, 10) == 0);
+    for (int i = 10; i < 3 * BLOCK_SIZE; i++) {
+        assert(striped_buff[i] == 0);
+    }
+    assert(striped_buff[3 * BLOCK_SIZE] == 'X');
+
+    // assert truncating frees the blocks past the new size and zeroes the tail of the last one,
+    // copying it rather than touching a clone sharing it
+    ssize_t truncated_clone = clone_inode(fs, 2);
+    assert(truncated_clone == 3);
+    assert(truncate_inode(fs, 2, 5));
+    assert(stat_inode(fs, 2) == 5);
+    assert(map_inode_blocks(fs, 2, 0, 4, mapped) == 4 && mapped[0] != 0 && mapped[3] == 0);
+    assert(truncate_inode(fs, 2, 2 * BLOCK_SIZE));
+    assert(read_from_inode(fs, 2, striped_buff, 2 * BLOCK_SIZE, 0) == 2 * BLOCK_SIZE);
+    assert(memcmp(striped_buff, striped_data, 5) == 0);
+    for (int i = 5; i < 2 * BLOCK_SIZE; i++) {
+        assert(striped_buff[i] == 0);
+    }
+    assert(read_from_inode(fs, truncated_clone, striped_buff, 10, 0) == 10);
+    assert(memcmp(striped_buff, striped_data, 10) == 0);
+    assert(truncate_inode(fs, 2, 0));
+    assert(map_inode_blocks(fs, 2, 0, 1, mapped) == 1 && mapped[0] == 0);
+    assert(!truncate_inode(fs, 2, MAX_INODE_SIZE + 1));
+
+    // assert truncating to a new last block that is a hole in the indirect range allocates nothing
+    size_t indirect_hole = POINTERS_PER_INODE + 1;
+    assert(write_to_inode(fs, 2, "Y", 1, (indirect_hole + 2) * BLOCK_SIZE) == 1);
+    size_t used_blocks = 0;
+    for (size_t i = 0; i < NUMBER_OF_DATA_BLOCKS(fs->super.nblocks); i++) {
+        used_blocks += fs->block_refs[i] != 0;
+    }
+    assert(truncate_inode(fs, 2, indirect_hole * BLOCK_SIZE + 10));
+    for (size_t i = 0; i < NUMBER_OF_DATA_BLOCKS(fs->super.nblocks); i++) {
+        used_blocks -= fs->block_refs[i] != 0;
+    }
+    assert(used_blocks == 1);
+    assert(map_inode_blocks(fs, 2, indirect_hole, 1, mapped) == 1 && mapped[0] == 0);
+    assert(truncate_inode(fs, 2, 0));
+
+    free_fs(fs);
+    close_disk(disk);
+
+    // assert the members can only be reopened with the geometry they were striped with
+    const char *reordered[] = {"./disk.1", "./disk.0", "./disk.2"};
+    striped.stripe_blocks = 3;
+    assert(open_striped_disk(members, 3, 30, &striped) == NULL);
+    striped.stripe_blocks = 2;
+    assert(open_striped_disk(reordered, 3, 30, &striped) == NULL);
+    assert(open_striped_disk(members, 2, 30, &striped) == NULL);
+    disk = open_striped_disk(members, 3, 30, &striped);
+    assert(disk != NULL);
+    fs = mount_fs(disk);
+    assert(fs != NULL);
+    assert(read_from_inode(fs, truncated_clone, striped_buff, 10, 0) == 10);
+    assert(memcmp(striped_buff, striped_data, 10) == 0);
+    free_fs(fs);
+    close_disk(disk);
+
+    // assert snapshots chain their descriptor blocks when there are more inode blocks than
+    // a single descriptor block can point to
+    size_t big_nblocks = (POINTERS_PER_BLOCK + 2) * 10;
+    disk = open_disk("./disk.snap", big_nblocks);
+    assert(disk != NULL);
+    assert(format(disk));
+    fs = mount_fs(disk);
+    assert(fs != NULL);
+    assert(fs->super.inblocks > POINTERS_PER_BLOCK);
+
+    size_t last_inode = fs->super.inodes_count - 1;
+    assert(create_inode(fs) == 0);
+    assert(create_inode_at(fs, last_inode - 1));
+    assert(create_inode_at(fs, last_inode));
+    assert(write_to_inode(fs, 0, msg, sizeof(msg), 0) == sizeof(msg));
+    assert(write_to_inode(fs, last_inode - 1, msg, sizeof(msg), 0) == sizeof(msg));
+    assert(write_to_inode(fs, last_inode, msg, sizeof(msg), 0) == sizeof(msg));
+
+    // assert a snapshot failing partway drops every reference and block it took
+    size_t big_data_blocks = NUMBER_OF_DATA_BLOCKS(big_nblocks);
+    uint16_t *big_refs = malloc(big_data_blocks * sizeof(uint16_t));
+    assert(map_inode_blocks(fs, last_inode, 0, 1, mapped) == 1);
+    fs->block_refs[mapped[0] - DATA_FIRST_BLOCK(big_nblocks)] = MAX_BLOCK_REFS;
+    memcpy(big_refs, fs->block_refs, big_data_blocks * sizeof(uint16_t));
+    assert(snapshot_create(fs) == -1);
+    assert(memcmp(big_refs, fs->block_refs, big_data_blocks * sizeof(uint16_t)) == 0);
+    fs->block_refs[mapped[0] - DATA_FIRST_BLOCK(big_nblocks)] = 1;
+    memcpy(big_refs, fs->block_refs, big_data_blocks * sizeof(uint16_t));
+
+    snap = snapshot_create(fs);
+    assert(snap == 0);
+    assert(write_to_inode(fs, last_inode, "HELLO", 5, 0) == 5);
+    assert(read_from_snapshot(fs, snap, last_inode, msg_buff, sizeof(msg), 0) == sizeof(msg));
+    assert(memcmp(msg, msg_buff, sizeof(msg)) == 0);
+    assert(read_from_snapshot(fs, snap, 0, msg_buff, sizeof(msg), 0) == sizeof(msg));
+    assert(memcmp(msg, msg_buff, sizeof(msg)) == 0);
+
+    uint16_t *remount_refs = malloc(big_data_blocks * sizeof(uint16_t));
+    memcpy(remount_refs, fs->block_refs, big_data_blocks * sizeof(uint16_t));
+    unmount(disk);
+    free_fs(fs);
+    fs = mount_fs(disk);
+    assert(fs != NULL);
+    assert(memcmp(remount_refs, fs->block_refs, big_data_blocks * sizeof(uint16_t)) == 0);
+
+    // assert deleting it frees the copied inode blocks, the descriptors and the overwritten block
+    assert(snapshot_delete(fs, snap));
+    assert(fs->block_refs[mapped[0] - DATA_FIRST_BLOCK(big_nblocks)] == 0);
+    size_t used_before = 0, used_after = 0;
+    for (size_t i = 0; i < big_data_blocks; i++) {
+        used_before += big_refs[i] != 0;
+        used_after += fs->block_refs[i] != 0;
+    }
+    assert(used_after == used_before);
+
+    free(big_refs);
+    free(remount_refs);
+    free(striped_data);
+    free(striped_buff);
+    free_fs(fs);
+    close_disk(disk);
+    remove("./disk.snap");
+    for (int i = 0; i < 3; i++) {
+        remove(members[i]);
+    }
+
     return 0;
 }
@@ -0,0 +1,600 @@
+// FUSE frontend for SimpleFS images.
+//
+// usage: simplefs_fuse <image> <mountpoint> [fuse options]
+//
+// the image must already be formatted. SimpleFS has no directories, so the mount
+// exposes a single flat root directory in which every valid inode appears as a
+// regular file named by its inode number ("0", "1", ...). creating a file is only
+// possible under the name of a free inode number.
+#define FUSE_USE_VERSION 34
+
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/statvfs.h>
+
+#include "src/fs.h"
+
+// SimpleFS inode n is exposed as fuse inode n + INO_BASE, since fuse reserves 1 for the root.
+#define INO_BASE 2
+#define TO_INODE(ino) ((ino) - INO_BASE)
+#define TO_FUSE_INO(inode_num) ((inode_num) + INO_BASE)
+
+// largest read/write request the kernel is asked to send in one go.
+#define MAX_IO_SIZE (1024 * 1024)
+
+// attributes never change behind the kernel's back, so they may be cached for a while.
+#define ATTR_TIMEOUT 1.0
+
+typedef struct FuseContext {
+
+    FileSystem *fs;
+
+    // the filesystem is not thread safe, every request that touches it holds this lock
+    pthread_mutex_t lock;
+
+} FuseContext;
+
+static FuseContext *ctx_of(fuse_req_t req) {
+    return (FuseContext*)fuse_req_userdata(req);
+}
+
+// parses a file name into an inode number. returns -1 if name is not a valid inode number.
+static ssize_t parse_name(FileSystem *fs, const char *name) {
+    char *end;
+    unsigned long n = strtoul(name, &end, 10);
+
+    if (*name == '\0' || *end != '\0' || (name[0] == '0' && name[1] != '\0') || n >= fs->super.inodes_count) {
+        return -1;
+    }
+
+    return n;
+}
+
+// fills st for the given fuse inode. must be called with the lock held.
+static int fill_attr(FileSystem *fs, fuse_ino_t ino, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_ino = ino;
+    st->st_blksize = BLOCK_SIZE;
+
+    if (ino == FUSE_ROOT_ID) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        return 0;
+    }
+
+    if (ino < INO_BASE || TO_INODE(ino) >= fs->super.inodes_count || fs->free_inodes[TO_INODE(ino)]) {
+        return ENOENT;
+    }
+
+    ssize_t size = stat_inode(fs, TO_INODE(ino));
+    if (size < 0) {
+        return EIO;
+    }
+
+    st->st_mode = S_IFREG | 0644;
+    st->st_nlink = 1;
+    st->st_size = size;
+    st->st_blocks = (size + 511) / 512;
+
+    return 0;
+}
+
+static void sfs_init(void *userdata, struct fuse_conn_info *conn) {
+    conn->max_write = MAX_IO_SIZE;
+    conn->max_readahead = MAX_IO_SIZE;
+
+    // let libfuse splice file data straight from the disk image into the reply pipe
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
+
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE) {
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
+    }
+}
+
+static void sfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    FuseContext *ctx = ctx_of(req);
+    struct fuse_entry_param e;
+
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    memset(&e, 0, sizeof(e));
+
+    pthread_mutex_lock(&ctx->lock);
+    ssize_t inode_num = parse_name(ctx->fs, name);
+    int err = inode_num < 0 ? ENOENT : fill_attr(ctx->fs, TO_FUSE_INO(inode_num), &e.attr);
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    e.ino = TO_FUSE_INO(inode_num);
+    e.attr_timeout = ATTR_TIMEOUT;
+    e.entry_timeout = ATTR_TIMEOUT;
+    fuse_reply_entry(req, &e);
+}
+
+static void sfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    FuseContext *ctx = ctx_of(req);
+    struct stat st;
+
+    pthread_mutex_lock(&ctx->lock);
+    int err = fill_attr(ctx->fs, ino, &st);
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+static void sfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    FuseContext *ctx = ctx_of(req);
+    struct stat st;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    int err = fill_attr(ctx->fs, ino, &st);
+
+    // only the size can be changed, other attributes are fixed
+    if (!err && (to_set & FUSE_SET_ATTR_SIZE)) {
+        if (attr->st_size < 0 || attr->st_size > MAX_INODE_SIZE) {
+            err = EFBIG;
+        } else if (!truncate_inode(ctx->fs, TO_INODE(ino), attr->st_size)) {
+            err = EIO;
+        } else {
+            err = fill_attr(ctx->fs, ino, &st);
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+static void sfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    FuseContext *ctx = ctx_of(req);
+
+    if (ino != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    char *buff = (char*)malloc(size);
+    if (buff == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    // offsets 0 and 1 are "." and "..", offset inode_num + 2 is inode inode_num
+    size_t n = 0;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+
+    pthread_mutex_lock(&ctx->lock);
+
+    for (off_t i = off; ; i++) {
+        char name[32];
+        size_t len;
+
+        if (i < 2) {
+            st.st_ino = FUSE_ROOT_ID;
+            st.st_mode = S_IFDIR;
+            strcpy(name, i == 0 ? "." : "..");
+        } else {
+            size_t inode_num = i - 2;
+            if (inode_num >= ctx->fs->super.inodes_count) {
+                break;
+            }
+
+            if (ctx->fs->free_inodes[inode_num]) {
+                continue;
+            }
+
+            st.st_ino = TO_FUSE_INO(inode_num);
+            st.st_mode = S_IFREG;
+            snprintf(name, sizeof(name), "%ld", inode_num);
+        }
+
+        len = fuse_add_direntry(req, buff + n, size - n, name, &st, i + 1);
+        if (len > size - n) {
+            break;
+        }
+
+        n += len;
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    fuse_reply_buf(req, buff, n);
+    free(buff);
+}
+
+static void sfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    FuseContext *ctx = ctx_of(req);
+    struct stat st;
+
+    pthread_mutex_lock(&ctx->lock);
+    int err = fill_attr(ctx->fs, ino, &st);
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    fuse_reply_open(req, fi);
+}
+
+// replies to a read by splicing the data blocks straight out of the disk image.
+// only possible when every block in the range is allocated, since holes have no
+// block in the image to splice from. returns false if the caller should fall back to a buffered read.
+// must be called with the lock held, so the blocks can't be reused before the reply is sent.
+// skipped for O_DIRECT disks, since splicing would go through the page cache they bypass,
+// and for striped disks, whose blocks aren't at their BLOCK_OFFSET in a single image.
+static bool reply_spliced(fuse_req_t req, FileSystem *fs, size_t inode_num, size_t size, size_t off) {
+    if (fs->disk->direct || fs->disk->nmembers > 1) {
+        return false;
+    }
+
+    size_t first = off / BLOCK_SIZE;
+    size_t count = (off + size - 1) / BLOCK_SIZE - first + 1;
+
+    uint32_t *blocks = (uint32_t*)malloc(count * sizeof(uint32_t));
+    struct fuse_bufvec *bufv = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+    if (blocks == NULL || bufv == NULL) {
+        free(blocks);
+        free(bufv);
+        return false;
+    }
+
+    if (map_inode_blocks(fs, inode_num, first, count, blocks) != count) {
+        free(blocks);
+        free(bufv);
+        return false;
+    }
+
+    memset(bufv, 0, sizeof(struct fuse_bufvec));
+
+    size_t n = 0;
+    size_t remaining = size;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!blocks[i]) {
+            free(blocks);
+            free(bufv);
+            return false;
+        }
+
+        size_t boff = i == 0 ? off % BLOCK_SIZE : 0;
+        size_t s = BLOCK_SIZE - boff < remaining ? BLOCK_SIZE - boff : remaining;
+        off_t pos = BLOCK_OFFSET((off_t)blocks[i]) + boff;
+
+        // coalesce physically contiguous blocks into a single buffer
+        if (n > 0 && bufv->buf[n - 1].pos + bufv->buf[n - 1].size == pos) {
+            bufv->buf[n - 1].size += s;
+        } else {
+            bufv->buf[n].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            bufv->buf[n].fd = fs->disk->fd;
+            bufv->buf[n].pos = pos;
+            bufv->buf[n].size = s;
+            n++;
+        }
+
+        remaining -= s;
+    }
+
+    bufv->count = n;
+    bufv->idx = 0;
+    bufv->off = 0;
+
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+
+    free(blocks);
+    free(bufv);
+
+    return true;
+}
+
+static void sfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    FuseContext *ctx = ctx_of(req);
+    size_t inode_num = TO_INODE(ino);
+
+    pthread_mutex_lock(&ctx->lock);
+
+    ssize_t file_size = stat_inode(ctx->fs, inode_num);
+    if (file_size < 0) {
+        pthread_mutex_unlock(&ctx->lock);
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    if (off >= file_size || size == 0) {
+        pthread_mutex_unlock(&ctx->lock);
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+
+    if (off + size > file_size) {
+        size = file_size - off;
+    }
+
+    if (reply_spliced(req, ctx->fs, inode_num, size, off)) {
+        pthread_mutex_unlock(&ctx->lock);
+        return;
+    }
+
+    char *buff = (char*)malloc(size);
+    if (buff == NULL) {
+        pthread_mutex_unlock(&ctx->lock);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    ssize_t n = read_from_inode(ctx->fs, inode_num, buff, size, off);
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (n < 0) {
+        fuse_reply_err(req, EIO);
+    } else {
+        fuse_reply_buf(req, buff, n);
+    }
+
+    free(buff);
+}
+
+static void sfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    FuseContext *ctx = ctx_of(req);
+
+    // past the largest file an inode can address, as opposed to a full disk
+    if ((size_t)off + size > MAX_INODE_SIZE) {
+        fuse_reply_err(req, EFBIG);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ssize_t n = write_to_inode(ctx->fs, TO_INODE(ino), (char*)buf, size, off);
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (n < 0) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    if (n == 0 && size > 0) {
+        fuse_reply_err(req, ENOSPC);
+        return;
+    }
+
+    fuse_reply_write(req, n);
+}
+
+static void sfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    FuseContext *ctx = ctx_of(req);
+    struct fuse_entry_param e;
+
+    if (parent != FUSE_ROOT_ID || !S_ISREG(mode)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    memset(&e, 0, sizeof(e));
+
+    pthread_mutex_lock(&ctx->lock);
+
+    int err = 0;
+    ssize_t inode_num = parse_name(ctx->fs, name);
+    if (inode_num < 0) {
+        err = EINVAL;
+    } else if (!ctx->fs->free_inodes[inode_num]) {
+        err = EEXIST;
+    } else if (!create_inode_at(ctx->fs, inode_num)) {
+        err = EIO;
+    } else {
+        err = fill_attr(ctx->fs, TO_FUSE_INO(inode_num), &e.attr);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    e.ino = TO_FUSE_INO(inode_num);
+    e.attr_timeout = ATTR_TIMEOUT;
+    e.entry_timeout = ATTR_TIMEOUT;
+    fuse_reply_create(req, &e, fi);
+}
+
+static void sfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    FuseContext *ctx = ctx_of(req);
+
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+
+    int err = 0;
+    ssize_t inode_num = parse_name(ctx->fs, name);
+    if (inode_num < 0 || ctx->fs->free_inodes[inode_num]) {
+        err = ENOENT;
+    } else if (!remove_inode(ctx->fs, inode_num)) {
+        err = EIO;
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    fuse_reply_err(req, err);
+}
+
+static void sfs_statfs(fuse_req_t req, fuse_ino_t ino) {
+    FuseContext *ctx = ctx_of(req);
+    struct statvfs st;
+
+    memset(&st, 0, sizeof(st));
+
+    pthread_mutex_lock(&ctx->lock);
+
+    FileSystem *fs = ctx->fs;
+    int ndata = NUMBER_OF_DATA_BLOCKS(fs->super.nblocks);
+    fsblkcnt_t free_blocks = 0;
+    fsfilcnt_t free_inodes = 0;
+
+    for (int i = 0; i < ndata; i++) {
+        free_blocks += fs->block_refs[i] ? 0 : 1;
+    }
+
+    for (int i = 0; i < fs->super.inodes_count; i++) {
+        free_inodes += fs->free_inodes[i] ? 1 : 0;
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    st.f_bsize = BLOCK_SIZE;
+    st.f_frsize = BLOCK_SIZE;
+    st.f_blocks = ndata;
+    st.f_bfree = free_blocks;
+    st.f_bavail = free_blocks;
+    st.f_files = fs->super.inodes_count;
+    st.f_ffree = free_inodes;
+    st.f_favail = free_inodes;
+    st.f_namemax = 10;
+
+    fuse_reply_statfs(req, &st);
+}
+
+static void sfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    FuseContext *ctx = ctx_of(req);
+
+    fuse_reply_err(req, sync_disk(ctx->fs->disk) ? 0 : EIO);
+}
+
+static const struct fuse_lowlevel_ops sfs_ops = {
+    .init = sfs_init,
+    .lookup = sfs_lookup,
+    .getattr = sfs_getattr,
+    .setattr = sfs_setattr,
+    .readdir = sfs_readdir,
+    .open = sfs_open,
+    .read = sfs_read,
+    .write = sfs_write,
+    .create = sfs_create,
+    .unlink = sfs_unlink,
+    .statfs = sfs_statfs,
+    .fsync = sfs_fsync,
+};
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printf("usage: %s <image> <mountpoint> [fuse options]\n", argv[0]);
+        return 1;
+    }
+
+    const char *image = argv[1];
+
+    struct stat st;
+    if (stat(image, &st) == -1) {
+        perror("simplefs_fuse: failed to stat disk image");
+        return 1;
+    }
+
+    Disk *disk = open_disk(image, st.st_size / BLOCK_SIZE);
+    if (disk == NULL) {
+        return 1;
+    }
+
+    FuseContext ctx;
+    ctx.fs = mount_fs(disk);
+    if (ctx.fs == NULL) {
+        close_disk(disk);
+        return 1;
+    }
+
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    // drop the image path and ask the kernel for large reads
+    argv[1] = argv[0];
+    struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv + 1);
+    fuse_opt_add_arg(&args, "-omax_read=1048576");
+
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se = NULL;
+    int ret = 1;
+
+    memset(&opts, 0, sizeof(opts));
+
+    if (fuse_parse_cmdline(&args, &opts) != 0) {
+        goto out;
+    }
+
+    if (opts.mountpoint == NULL) {
+        printf("usage: %s <image> <mountpoint> [fuse options]\n", argv[0]);
+        goto out;
+    }
+
+    se = fuse_session_new(&args, &sfs_ops, sizeof(sfs_ops), &ctx);
+    if (se == NULL) {
+        goto out;
+    }
+
+    if (fuse_set_signal_handlers(se) != 0) {
+        goto out;
+    }
+
+    if (fuse_session_mount(se, opts.mountpoint) != 0) {
+        fuse_remove_signal_handlers(se);
+        goto out;
+    }
+
+    fuse_daemonize(opts.foreground);
+
+    if (opts.singlethread) {
+        ret = fuse_session_loop(se);
+    } else {
+        struct fuse_loop_config config;
+        config.clone_fd = opts.clone_fd;
+        config.max_idle_threads = opts.max_idle_threads;
+        ret = fuse_session_loop_mt(se, &config);
+    }
+
+    fuse_session_unmount(se);
+    fuse_remove_signal_handlers(se);
+
+out:
+    if (se != NULL) {
+        fuse_session_destroy(se);
+    }
+
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    unmount(disk);
+    free_fs(ctx.fs);
+    close_disk(disk);
+    pthread_mutex_destroy(&ctx.lock);
+
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+#include "bufpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+// binds the memory range to the given numa node. called through the raw syscall to avoid depending on libnuma.
+static void bind_to_node(void *addr, size_t len, int numa_node) {
+    unsigned long nodemask[4] = {0};
+    unsigned long bits = sizeof(nodemask) * 8;
+
+    if (numa_node < 0 || (unsigned long)numa_node >= bits) {
+        printf("bufpool_create: numa node %d is out of range\n", numa_node);
+        return;
+    }
+
+    nodemask[numa_node / (sizeof(unsigned long) * 8)] |= 1ul << (numa_node % (sizeof(unsigned long) * 8));
+
+    if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, nodemask, bits + 1, 0) == -1) {
+        perror("bufpool_create: failed binding pool to numa node");
+    }
+}
+
+BufPool *bufpool_create(size_t nbuffs, size_t buff_size, bool hugepages, int numa_node) {
+    BufPool *pool = (BufPool*)calloc(1, sizeof(BufPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->nbuffs = nbuffs;
+    pool->buff_size = (buff_size + BUFPOOL_ALIGN - 1) / BUFPOOL_ALIGN * BUFPOOL_ALIGN;
+    pool->map_size = pool->nbuffs * pool->buff_size;
+
+    if (hugepages) {
+        size_t size = (pool->map_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+        void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            pool->base = (char*)base;
+            pool->map_size = size;
+            pool->hugepages = true;
+        }
+    }
+
+    if (pool->base == NULL && pool->map_size > 0) {
+        void *base = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            perror("bufpool_create: failed mapping buffer pool");
+            free(pool);
+            return NULL;
+        }
+
+        pool->base = (char*)base;
+
+        // no huge pages reserved, let the kernel back the pool with transparent huge pages
+        if (hugepages) {
+            madvise(pool->base, pool->map_size, MADV_HUGEPAGE);
+        }
+    }
+
+    if (numa_node != BUFPOOL_NUMA_LOCAL) {
+        bind_to_node(pool->base, pool->map_size, numa_node);
+    }
+
+    // fault the pool in up front, so the pages are placed on the node of the
+    // calling thread and no page faults happen on the I/O path
+    if (pool->base != NULL) {
+        memset(pool->base, 0, pool->map_size);
+    }
+
+    pool->free_list = (char**)malloc(nbuffs * sizeof(char*));
+    if (pool->free_list == NULL && nbuffs > 0) {
+        bufpool_destroy(pool);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < nbuffs; i++) {
+        pool->free_list[i] = pool->base + (nbuffs - 1 - i) * pool->buff_size;
+    }
+
+    pool->nfree = nbuffs;
+
+    return pool;
+}
+
+char *bufpool_get(BufPool *pool) {
+    if (pool->nfree > 0) {
+        return pool->free_list[--pool->nfree];
+    }
+
+    void *buff;
+    if (posix_memalign(&buff, BUFPOOL_ALIGN, pool->buff_size) != 0) {
+        return NULL;
+    }
+
+    pool->overflows++;
+
+    return (char*)buff;
+}
+
+void bufpool_put(BufPool *pool, char *buff) {
+    if (buff == NULL) {
+        return;
+    }
+
+    if (buff < pool->base || buff >= pool->base + pool->nbuffs * pool->buff_size) {
+        free(buff);
+        return;
+    }
+
+    pool->free_list[pool->nfree++] = buff;
+}
+
+void bufpool_destroy(BufPool *pool) {
+    if (pool->base != NULL) {
+        munmap(pool->base, pool->map_size);
+    }
+
+    free(pool->free_list);
+    free(pool);
+}
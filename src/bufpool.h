@@ -0,0 +1,51 @@
+#ifndef SIMPLEFS_BUFPOOL_H
+#define SIMPLEFS_BUFPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// alignment of every pool buffer. satisfies O_DIRECT on any device with a logical block size up to BLOCK_SIZE.
+#define BUFPOOL_ALIGN 4096
+
+// numa_node value for allocating the pool on the node of the calling thread.
+#define BUFPOOL_NUMA_LOCAL -1
+
+typedef struct BufPool {
+
+    // preallocated region holding nbuffs buffers of buff_size bytes
+    char *base;
+    size_t nbuffs;
+    size_t buff_size;
+
+    // number of bytes mapped for the region
+    size_t map_size;
+
+    // stack of free buffers
+    char **free_list;
+    size_t nfree;
+
+    // whether the region is backed by explicit huge pages
+    bool hugepages;
+
+    // number of buffers handed out from the heap because the pool was empty
+    uint64_t overflows;
+
+} BufPool;
+
+// creates a pool of nbuffs buffers of buff_size bytes each, aligned to BUFPOOL_ALIGN.
+// when hugepages is set the region is backed by huge pages if the system has any reserved,
+// and transparent huge pages are requested otherwise. the region's memory is bound to
+// numa_node, or faulted in by the calling thread for BUFPOOL_NUMA_LOCAL.
+BufPool *bufpool_create(size_t nbuffs, size_t buff_size, bool hugepages, int numa_node);
+
+// returns a free buffer. once the pool is exhausted buffers are allocated from the heap.
+char *bufpool_get(BufPool *pool);
+
+// returns a buffer obtained from bufpool_get to the pool.
+void bufpool_put(BufPool *pool, char *buff);
+
+// releases the pool's memory. all buffers must have been returned.
+void bufpool_destroy(BufPool *pool);
+
+#endif
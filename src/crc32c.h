@@ -0,0 +1,12 @@
+#ifndef SIMPLEFS_CRC32C_H
+#define SIMPLEFS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// computes the CRC32C (Castagnoli) checksum of len bytes at data, continuing from crc.
+// pass 0 as crc to start a new checksum. uses the SSE4.2 / ARMv8 CRC32 instructions
+// when the CPU supports them and a table driven implementation otherwise.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
@@ -1,63 +1,672 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "crc32c.h"
 #include "disk.h"
 
+// identifies the header at the start of every member of a striped disk
+#define STRIPE_MAGIC 0x5354524d
+
+// written to the first block of every member of a striped disk, so opening the members
+// with another stripe geometry or in another order fails instead of scrambling the blocks.
+typedef struct StripeHeader {
+
+    uint32_t magic;
+
+    // the member's position in stripe order
+    uint32_t member;
+
+    uint32_t nmembers;
+    uint32_t stripe_blocks;
+
+    // crc32c of the fields above
+    uint32_t checksum;
+
+} StripeHeader;
+
 Disk* open_disk(const char *path, int nblocks) {
-    int fd = open(path, O_CREAT | O_RDWR); 
+    return open_disk_with(path, nblocks, NULL);
+}
+
+Disk* open_disk_with(const char *path, int nblocks, const DiskOptions *opts) {
+    return open_striped_disk(&path, 1, nblocks, opts);
+}
+
+// opens the image at path and stretches it to nblocks blocks.
+// clears *direct if the image can't be opened with O_DIRECT.
+static int open_image(const char *path, off_t nblocks, bool *direct) {
+    int fd = open(path, O_CREAT | O_RDWR | (*direct ? O_DIRECT : 0), 0644);
+    if (fd == -1 && *direct && errno == EINVAL) {
+        printf("open_disk: O_DIRECT is not supported for %s, using buffered I/O\n", path);
+        *direct = false;
+        fd = open(path, O_CREAT | O_RDWR, 0644);
+    }
+
     if (fd == -1) {
         perror("open_disk: failed to open disk");
-        return NULL;
+        return -1;
     }
 
-    if (lseek(fd, BLOCK_OFFSET(nblocks) - 1, SEEK_SET) == -1) {
+    // stretch the disk image to its full size
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_size < BLOCK_OFFSET(nblocks) && ftruncate(fd, BLOCK_OFFSET(nblocks)) == -1)) {
         close(fd);
         perror("open_disk: failed sterching disk image");
-        return NULL;   
+        return -1;
     }
 
-    if (write(fd, "\0", 1) < 0) {
-        close(fd);
-        perror("open_disk: failed writing to disk image file");
+    return fd;
+}
+
+static bool check_stripe_headers(Disk *disk);
+static bool start_workers(Disk *disk);
+
+Disk* open_striped_disk(const char **paths, int npaths, int nblocks, const DiskOptions *opts) {
+    DiskOptions defaults = {0};
+
+    if (opts == NULL) {
+        opts = &defaults;
+    }
+
+    if (npaths < 1 || npaths > DISK_MAX_MEMBERS || nblocks <= 0) {
+        printf("open_disk: invalid disk geometry, %d images of %d blocks\n", npaths, nblocks);
         return NULL;
     }
 
-    Disk* disk = (Disk*)malloc(sizeof(disk));
+    // a single image holds all the blocks in one stripe
+    int stripe_blocks = npaths == 1 ? nblocks : (opts->stripe_blocks > 0 ? opts->stripe_blocks : DEFAULT_STRIPE_BLOCKS);
+    int stripes = (nblocks + stripe_blocks - 1) / stripe_blocks;
+    int first_block = npaths == 1 ? 0 : 1;
+    off_t member_blocks = first_block + (off_t)((stripes + npaths - 1) / npaths) * stripe_blocks;
+
+    Disk* disk = (Disk*)calloc(1, sizeof(Disk));
+    if (disk == NULL) {
+        printf("open_disk: failed allocating disk\n");
+        return NULL;
+    }
 
-    disk->fd = fd;
     disk->nblocks = nblocks;
     disk->mounted = false;
+    disk->stripe_blocks = stripe_blocks;
+    disk->member_first_block = first_block;
+
+    for (int i = 0; i < npaths; i++) {
+        bool direct = opts->direct;
+
+        int fd = open_image(paths[i], member_blocks, &direct);
+        if (fd == -1) {
+            close_disk(disk);
+            return NULL;
+        }
+
+        disk->fds[disk->nmembers++] = fd;
+        disk->direct |= direct;
+    }
+
+    disk->fd = disk->fds[0];
+
+    if (disk->nmembers > 1 && (!check_stripe_headers(disk) || !start_workers(disk))) {
+        close_disk(disk);
+        return NULL;
+    }
+
+    size_t pool_blocks = opts->pool_blocks > 0 ? opts->pool_blocks : DEFAULT_POOL_BLOCKS;
+    int numa_node = opts->bind_numa ? opts->numa_node : BUFPOOL_NUMA_LOCAL;
+
+    disk->pool = bufpool_create(pool_blocks, BLOCK_SIZE, opts->hugepages, numa_node);
+    if (disk->pool == NULL) {
+        printf("open_disk: failed creating block buffer pool\n");
+        close_disk(disk);
+        return NULL;
+    }
 
     return disk; 
 }
 
-bool write_to_disk(Disk *disk, int blocknum, char *data) {
-    off_t offset = lseek(disk->fd, BLOCK_OFFSET(blocknum), SEEK_SET);
-    if (offset == -1) {
-        perror("write_to_disk: failed offsetting with the given offset");
+static uint32_t stripe_header_checksum(const StripeHeader *header) {
+    return crc32c(0, header, offsetof(StripeHeader, checksum));
+}
+
+// checks every member's stripe header against the disk's geometry and the member's position.
+// if none of the members has a header yet, the disk is new and the headers are written.
+static bool check_stripe_headers(Disk *disk) {
+    StripeHeader headers[DISK_MAX_MEMBERS];
+    int fresh = 0;
+    bool ok = true;
+
+    char *buff = (char*)aligned_alloc(BUFPOOL_ALIGN, BLOCK_SIZE);
+    if (buff == NULL) {
+        printf("open_disk: failed allocating stripe header buffer\n");
         return false;
     }
 
-    if (write(disk->fd, data, BLOCK_SIZE) == -1) {
-        perror("write_to_disk: failed to write block to disk");
-        return true;
+    for (int i = 0; ok && i < disk->nmembers; i++) {
+        if (pread(disk->fds[i], buff, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+            perror("open_disk: failed reading stripe header");
+            ok = false;
+            break;
+        }
+
+        memcpy(&headers[i], buff, sizeof(StripeHeader));
+        fresh += headers[i].magic == 0;
     }
 
-    return true;
+    for (int i = 0; ok && i < disk->nmembers; i++) {
+        StripeHeader expected = {
+            .magic = STRIPE_MAGIC,
+            .member = i,
+            .nmembers = disk->nmembers,
+            .stripe_blocks = disk->stripe_blocks,
+        };
+        expected.checksum = stripe_header_checksum(&expected);
+
+        if (fresh == disk->nmembers) {
+            memset(buff, 0, BLOCK_SIZE);
+            memcpy(buff, &expected, sizeof(StripeHeader));
+
+            if (pwrite(disk->fds[i], buff, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+                perror("open_disk: failed writing stripe header");
+                ok = false;
+            }
+        } else if (headers[i].magic != STRIPE_MAGIC || headers[i].checksum != stripe_header_checksum(&headers[i])) {
+            printf("open_disk: member %d has no valid stripe header\n", i);
+            ok = false;
+        } else if (memcmp(&headers[i], &expected, sizeof(StripeHeader)) != 0) {
+            printf("open_disk: member %d was striped as member %u of %u with %u block stripes, not member %d of %d with %d block stripes\n",
+                   i, headers[i].member, headers[i].nmembers, headers[i].stripe_blocks, i, disk->nmembers, disk->stripe_blocks);
+            ok = false;
+        }
+    }
+
+    free(buff);
+
+    return ok;
 }
 
-bool read_from_disk(Disk *disk, int blocknum, char *buff) {
-    off_t offset = lseek(disk->fd, BLOCK_OFFSET(blocknum), SEEK_SET);
-    if (offset == -1) {
-        perror("read_from_disk: failed offsetting with the given offset");
-        return false;
+char *disk_buffer_get(Disk *disk) {
+    return bufpool_get(disk->pool);
+}
+
+void disk_buffer_put(Disk *disk, char *buff) {
+    bufpool_put(disk->pool, buff);
+}
+
+// O_DIRECT requires buffers aligned to the device's logical block size
+static bool needs_bounce(Disk *disk, const char *buff) {
+    return disk->direct && ((uintptr_t)buff % BUFPOOL_ALIGN) != 0;
+}
+
+// returns the member holding block blocknum and sets offset to the block's offset in it.
+static int disk_locate(Disk *disk, int blocknum, off_t *offset) {
+    int stripe = blocknum / disk->stripe_blocks;
+
+    *offset = BLOCK_OFFSET((off_t)(disk->member_first_block + stripe / disk->nmembers * disk->stripe_blocks + blocknum % disk->stripe_blocks));
+
+    return stripe % disk->nmembers;
+}
+
+// maximum number of consecutive blocks merged into a single vectored transfer
+#define MAX_RUN_BLOCKS 256
+
+// a transfer queued on one member of the disk.
+typedef struct MemberIo {
+
+    DiskIo *io;
+
+    // aligned buffer transferred to / from the member, a bounce buffer or the io's own buffer.
+    // NULL if no buffer could be allocated
+    char *buff;
+
+    // offset of the block in the member
+    off_t offset;
+
+    // time the transfer took in nanoseconds
+    uint64_t latency;
+
+    // errno of a failed transfer, 0 on success
+    int error;
+
+} MemberIo;
+
+typedef struct Member {
+
+    int fd;
+
+    // the member's transfers, sorted by offset
+    MemberIo *ios;
+    size_t count;
+
+    // next member queued on the same worker
+    struct Member *next;
+
+    // set by the worker once the member's transfers are done
+    bool done;
+
+} Member;
+
+// a thread serving the transfers of one member of a striped disk.
+typedef struct DiskWorker {
+
+    pthread_t thread;
+    bool started;
+
+    // guards the queue, stop and the done flags of queued members
+    pthread_mutex_t lock;
+
+    // signaled when a member is queued or the worker is stopped
+    pthread_cond_t wake;
+
+    // broadcast when a queued member is done
+    pthread_cond_t done;
+
+    // members waiting for the worker, in submission order
+    Member *head;
+    Member *tail;
+
+    bool stop;
+
+} DiskWorker;
+
+static int member_io_cmp(const void *a, const void *b) {
+    const MemberIo *x = (const MemberIo*)a;
+    const MemberIo *y = (const MemberIo*)b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// transfers count blocks at consecutive offsets with a single vectored call. if the
+// transfer comes up short the blocks are transferred one by one to find the failing ones.
+static void member_run(int fd, MemberIo *run, size_t count) {
+    struct iovec iov[MAX_RUN_BLOCKS];
+    bool write = run[0].io->write;
+
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = run[i].buff;
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+
+    uint64_t start = stats_now_ns();
+
+    ssize_t n = write ? pwritev(fd, iov, count, run[0].offset) : preadv(fd, iov, count, run[0].offset);
+    if (n == (ssize_t)(count * BLOCK_SIZE)) {
+        uint64_t latency = stats_now_ns() - start;
+
+        for (size_t i = 0; i < count; i++) {
+            run[i].latency = latency;
+        }
+
+        return;
     }
 
-    if (read(disk->fd, buff, BLOCK_SIZE) == -1) {
-        perror("read_from_disk: failed reading block from disk");
+    for (size_t i = 0; i < count; i++) {
+        start = stats_now_ns();
+
+        n = write ? pwrite(fd, run[i].buff, BLOCK_SIZE, run[i].offset) : pread(fd, run[i].buff, BLOCK_SIZE, run[i].offset);
+        if (n == -1) {
+            run[i].error = errno;
+        } else if (n != BLOCK_SIZE) {
+            run[i].error = EIO;
+        }
+
+        run[i].latency = stats_now_ns() - start;
+    }
+}
+
+// performs a member's transfers, merging runs of consecutive blocks.
+static void *member_work(void *arg) {
+    Member *m = (Member*)arg;
+
+    for (size_t i = 0, j; i < m->count; i = j) {
+        MemberIo *first = &m->ios[i];
+
+        if (first->buff == NULL) {
+            j = i + 1;
+            continue;
+        }
+
+        for (j = i + 1; j < m->count && j - i < MAX_RUN_BLOCKS; j++) {
+            MemberIo *next = &m->ios[j];
+
+            if (next->buff == NULL || next->io->write != first->io->write || next->offset != m->ios[j - 1].offset + BLOCK_SIZE) {
+                break;
+            }
+        }
+
+        member_run(m->fd, first, j - i);
+    }
+
+    return NULL;
+}
+
+// serves the members queued on a worker until it is stopped.
+static void *worker_run(void *arg) {
+    DiskWorker *w = (DiskWorker*)arg;
+
+    pthread_mutex_lock(&w->lock);
+
+    for (;;) {
+        while (w->head == NULL && !w->stop) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+
+        if (w->head == NULL) {
+            break;
+        }
+
+        Member *m = w->head;
+        w->head = m->next;
+        if (w->head == NULL) {
+            w->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&w->lock);
+        member_work(m);
+        pthread_mutex_lock(&w->lock);
+
+        m->done = true;
+        pthread_cond_broadcast(&w->done);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+// starts a worker thread for every member of a striped disk.
+static bool start_workers(Disk *disk) {
+    disk->workers = (DiskWorker*)calloc(disk->nmembers, sizeof(DiskWorker));
+    if (disk->workers == NULL) {
+        printf("open_disk: failed allocating member workers\n");
         return false;
     }
 
+    for (int i = 0; i < disk->nmembers; i++) {
+        DiskWorker *w = &disk->workers[i];
+
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, NULL);
+        pthread_cond_init(&w->done, NULL);
+    }
+
+    for (int i = 0; i < disk->nmembers; i++) {
+        DiskWorker *w = &disk->workers[i];
+
+        w->started = pthread_create(&w->thread, NULL, worker_run, w) == 0;
+        if (!w->started) {
+            printf("open_disk: failed starting worker for member %d\n", i);
+            return false;
+        }
+    }
+
     return true;
 }
 
+// stops the workers started by start_workers, once they have served their queues.
+static void stop_workers(Disk *disk) {
+    for (int i = 0; i < disk->nmembers; i++) {
+        DiskWorker *w = &disk->workers[i];
+
+        if (w->started) {
+            pthread_mutex_lock(&w->lock);
+            w->stop = true;
+            pthread_cond_signal(&w->wake);
+            pthread_mutex_unlock(&w->lock);
+
+            pthread_join(w->thread, NULL);
+        }
+
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->wake);
+        pthread_cond_destroy(&w->done);
+    }
+
+    free(disk->workers);
+}
+
+// hands a member's transfers to its worker.
+static void worker_queue(DiskWorker *w, Member *m) {
+    m->next = NULL;
+    m->done = false;
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->tail != NULL) {
+        w->tail->next = m;
+    } else {
+        w->head = m;
+    }
+
+    w->tail = m;
+
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// waits for the worker to be done with a member queued by worker_queue.
+static void worker_wait(DiskWorker *w, Member *m) {
+    pthread_mutex_lock(&w->lock);
+
+    while (!m->done) {
+        pthread_cond_wait(&w->done, &w->lock);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+}
+
+// performs the transfers counting them in stats. bounce buffers come from the disk's pool if pooled,
+// otherwise from the heap, so that threads with their own stats can submit at once.
+static bool submit(Disk *disk, DiskIo *ios, size_t n, IoStats *stats, bool pooled) {
+    bool ok = true;
+
+    if (n == 0) {
+        return true;
+    }
+
+    MemberIo one;
+    MemberIo *mios = n == 1 ? &one : (MemberIo*)malloc(n * sizeof(MemberIo));
+    if (mios == NULL) {
+        printf("disk_submit: failed allocating transfers\n");
+
+        for (size_t i = 0; i < n; i++) {
+            ios[i].ok = false;
+        }
+
+        return false;
+    }
+
+    Member members[DISK_MAX_MEMBERS];
+    memset(members, 0, sizeof(members));
+
+    for (size_t i = 0; i < n; i++) {
+        off_t offset;
+
+        ios[i].ok = false;
+
+        if (ios[i].blocknum < 0 || ios[i].blocknum >= disk->nblocks) {
+            printf("disk_submit: block %d is out of range\n", ios[i].blocknum);
+            ios[i].write ? stats->write_errors++ : stats->read_errors++;
+            ok = false;
+            continue;
+        }
+
+        members[disk_locate(disk, ios[i].blocknum, &offset)].count++;
+    }
+
+    // lay out each member's transfers contiguously
+    size_t queued = 0;
+
+    for (int m = 0; m < disk->nmembers; m++) {
+        members[m].fd = disk->fds[m];
+        members[m].ios = mios + queued;
+        queued += members[m].count;
+        members[m].count = 0;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        DiskIo *io = &ios[i];
+        off_t offset;
+
+        if (io->blocknum < 0 || io->blocknum >= disk->nblocks) {
+            continue;
+        }
+
+        Member *m = &members[disk_locate(disk, io->blocknum, &offset)];
+        MemberIo *mi = &m->ios[m->count++];
+
+        mi->io = io;
+        mi->buff = io->buff;
+        mi->offset = offset;
+        mi->latency = 0;
+        mi->error = 0;
+
+        if (needs_bounce(disk, io->buff)) {
+            mi->buff = pooled ? disk_buffer_get(disk) : (char*)aligned_alloc(BUFPOOL_ALIGN, BLOCK_SIZE);
+            if (mi->buff == NULL) {
+                mi->error = ENOMEM;
+                continue;
+            }
+
+            if (io->write) {
+                memcpy(mi->buff, io->buff, BLOCK_SIZE);
+            }
+
+            stats->bounces++;
+        }
+    }
+
+    // members work in parallel, each on its worker except the first busy
+    // one, which is served by the calling thread
+    Member *inline_member = NULL;
+    bool queued_any[DISK_MAX_MEMBERS] = {false};
+
+    for (int m = 0; m < disk->nmembers; m++) {
+        if (members[m].count > 1) {
+            qsort(members[m].ios, members[m].count, sizeof(MemberIo), member_io_cmp);
+        }
+
+        if (members[m].count == 0) {
+            continue;
+        }
+
+        if (inline_member == NULL) {
+            inline_member = &members[m];
+            continue;
+        }
+
+        worker_queue(&disk->workers[m], &members[m]);
+        queued_any[m] = true;
+    }
+
+    if (inline_member != NULL) {
+        member_work(inline_member);
+    }
+
+    for (int m = 0; m < disk->nmembers; m++) {
+        if (queued_any[m]) {
+            worker_wait(&disk->workers[m], &members[m]);
+        }
+    }
+
+    for (size_t i = 0; i < queued; i++) {
+        MemberIo *mi = &mios[i];
+        DiskIo *io = mi->io;
+
+        if (mi->buff != NULL && mi->buff != io->buff) {
+            if (!io->write && mi->error == 0) {
+                memcpy(io->buff, mi->buff, BLOCK_SIZE);
+            }
+
+            if (pooled) {
+                disk_buffer_put(disk, mi->buff);
+            } else {
+                free(mi->buff);
+            }
+        }
+
+        if (mi->error != 0) {
+            printf("disk_submit: failed %s block %d: %s\n", io->write ? "writing" : "reading", io->blocknum, strerror(mi->error));
+            io->write ? stats->write_errors++ : stats->read_errors++;
+            ok = false;
+            continue;
+        }
+
+        io->ok = true;
+
+        if (io->write) {
+            stats->writes++;
+            histogram_record(&stats->write_latency, mi->latency);
+        } else {
+            stats->reads++;
+            histogram_record(&stats->read_latency, mi->latency);
+        }
+    }
+
+    if (mios != &one) {
+        free(mios);
+    }
+
+    return ok;
+}
+
+bool disk_submit(Disk *disk, DiskIo *ios, size_t n) {
+    return submit(disk, ios, n, &disk->stats, true);
+}
+
+bool disk_submit_with(Disk *disk, DiskIo *ios, size_t n, IoStats *stats) {
+    return submit(disk, ios, n, stats, false);
+}
+
+bool write_to_disk(Disk *disk, int blocknum, char *data) {
+    DiskIo io = {.blocknum = blocknum, .buff = data, .write = true};
+
+    return disk_submit(disk, &io, 1);
+}
+
+bool read_from_disk(Disk *disk, int blocknum, char *buff) {
+    DiskIo io = {.blocknum = blocknum, .buff = buff, .write = false};
+
+    return disk_submit(disk, &io, 1);
+}
+
+void disk_prefetch(Disk *disk, int blocknum, int count) {
+    // O_DIRECT reads bypass the page cache the blocks would be read into
+    if (disk->direct) {
+        return;
+    }
+
+    int end = blocknum + count < disk->nblocks ? blocknum + count : disk->nblocks;
+
+    for (int b = blocknum < 0 ? 0 : blocknum, run; b < end; b += run) {
+        off_t offset;
+        int m = disk_locate(disk, b, &offset);
+
+        // the rest of the stripe is contiguous in the member
+        run = disk->stripe_blocks - b % disk->stripe_blocks;
+        if (run > end - b) {
+            run = end - b;
+        }
+
+        posix_fadvise(disk->fds[m], offset, BLOCK_OFFSET((off_t)run), POSIX_FADV_WILLNEED);
+    }
+}
+
+bool sync_disk(Disk *disk) {
+    bool ok = true;
+
+    for (int i = 0; i < disk->nmembers; i++) {
+        if (fdatasync(disk->fds[i]) == -1) {
+            perror("sync_disk: failed flushing disk image");
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
 void mount(Disk *disk) {
     disk->mounted = true;
 }
@@ -67,6 +676,17 @@ void unmount(Disk *disk) {
 }
 
 void close_disk(Disk *disk) {
-    close(disk->fd);
+    if (disk->workers != NULL) {
+        stop_workers(disk);
+    }
+
+    for (int i = 0; i < disk->nmembers; i++) {
+        close(disk->fds[i]);
+    }
+
+    if (disk->pool != NULL) {
+        bufpool_destroy(disk->pool);
+    }
+
     free(disk);
 }
\ No newline at end of file
@@ -7,31 +7,138 @@
 #include <errno.h>
 #include <stdbool.h>
 
+#include "bufpool.h"
+#include "stats.h"
+
 #define BLOCK_SIZE 4096
 #define BLOCK_OFFSET(blocknum) blocknum * BLOCK_SIZE
 
+// number of block buffers preallocated for a disk by default
+#define DEFAULT_POOL_BLOCKS 64
+
+// maximum number of images a disk can be striped across
+#define DISK_MAX_MEMBERS 16
+
+// number of consecutive blocks placed on one member before moving to the next, by default
+#define DEFAULT_STRIPE_BLOCKS 16
+
+// options for opening a disk. zero initialized options are the defaults.
+typedef struct DiskOptions {
+
+    // bypass the kernel's page cache with O_DIRECT. falls back to buffered I/O
+    // if the underlying filesystem doesn't support it.
+    bool direct;
+
+    // back the block buffer pool with huge pages
+    bool hugepages;
+
+    // bind the block buffer pool to numa_node. otherwise the pool is allocated
+    // on the node of the thread opening the disk.
+    bool bind_numa;
+    int numa_node;
+
+    // number of block buffers to preallocate, 0 for DEFAULT_POOL_BLOCKS
+    size_t pool_blocks;
+
+    // stripe unit in blocks for disks striped across several images, 0 for DEFAULT_STRIPE_BLOCKS
+    int stripe_blocks;
+
+} DiskOptions;
+
+typedef struct DiskIo {
+
+    // block to transfer
+    int blocknum;
+
+    // BLOCK_SIZE buffer to read into / write from
+    char *buff;
+
+    bool write;
+
+    // set by disk_submit to whether the transfer succeeded
+    bool ok;
+
+} DiskIo;
+
 typedef struct {
     
-    // file descriptor representing the disk image
+    // file descriptor representing the disk image, the first member's for a striped disk
     int fd;
 
+    // file descriptors of the images blocks are striped across, in stripe order
+    int fds[DISK_MAX_MEMBERS];
+    int nmembers;
+
+    // number of consecutive blocks placed on one member
+    int stripe_blocks;
+
+    // first block of each member holding disk blocks. a striped disk's members start
+    // with a header recording the stripe geometry and the member's position in it.
+    int member_first_block;
+
     // total number of blocks in the disk image
     int nblocks;
 
     // indicator whether there is a filesystem mounted on the disk
     bool mounted;
 
+    // block I/O counters and latencies
+    IoStats stats;
+
+    // whether the disk image was opened with O_DIRECT
+    bool direct;
+
+    // aligned block buffers all block I/O draws its temporary buffers from
+    BufPool *pool;
+
+    // one thread per member of a striped disk serving its transfers, NULL for a single image
+    struct DiskWorker *workers;
+
 } Disk;
 
 // opens a new emulated disk at the given path of size BLOCK_SIZE * nblocks.
 Disk* open_disk(const char *path, int nblocks);
 
+// like open_disk with the given options. opts may be NULL for the defaults.
+Disk* open_disk_with(const char *path, int nblocks, const DiskOptions *opts);
+
+// opens a disk of nblocks blocks striped RAID-0 style across the npaths images at paths.
+// block b lives in stripe b / stripe_blocks, and stripe s on member s % npaths.
+// every member gets a worker thread, running until the disk is closed.
+// the geometry is recorded in a header block at the start of every member, and reopening
+// the images with another stripe unit, member count or member order fails.
+// opts may be NULL for the defaults.
+Disk* open_striped_disk(const char **paths, int npaths, int nblocks, const DiskOptions *opts);
+
+// returns a BLOCK_SIZE buffer aligned for I/O on the given disk. not thread safe.
+char *disk_buffer_get(Disk *disk);
+
+// returns a buffer obtained from disk_buffer_get.
+void disk_buffer_put(Disk *disk, char *buff);
+
 // writes data block to the given disk at block #blocknum.
 bool write_to_disk(Disk *disk, int blocknum, char *data);
 
 // reads data block from the given disk at block #blocknum into buff.
 bool read_from_disk(Disk *disk, int blocknum, char *buff);
 
+// performs the n block transfers in ios, setting each one's ok. transfers to different members
+// of a striped disk run in parallel, and consecutive blocks of a member are merged into vectored I/O.
+// the order between transfers is unspecified, so ios must not write a block another io reads or writes.
+// returns true if all transfers succeeded.
+bool disk_submit(Disk *disk, DiskIo *ios, size_t n);
+
+// like disk_submit, but counts the transfers in stats instead of the disk's and doesn't touch the
+// buffer pool, so several threads may submit at once as long as each has its own stats.
+bool disk_submit_with(Disk *disk, DiskIo *ios, size_t n, IoStats *stats);
+
+// hints the kernel to read count blocks starting at blocknum into the page cache in the background.
+// a no-op for O_DIRECT disks.
+void disk_prefetch(Disk *disk, int blocknum, int count);
+
+// flushes the written blocks of all the disk's images to stable storage.
+bool sync_disk(Disk *disk);
+
 // mount an arbitrary filesystem to disk.
 void mount(Disk *disk);
 
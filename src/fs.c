@@ -1,32 +1,91 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "crc32c.h"
 #include "fs.h"
 
+// counts a public filesystem operation and dumps stats periodically if requested.
+static void fs_stats_tick(FileSystem *fs) {
+    fs->counters.ops++;
+
+    if (fs->stats_every && fs->counters.ops % fs->stats_every == 0) {
+        fs_dump_stats(fs, fs->stats_out);
+    }
+}
+
+void block_seal(union Block *block) {
+    block->meta.checksum = crc32c(0, block->meta.payload, sizeof(block->meta.payload));
+}
+
+bool block_verify(union Block *block) {
+    return block->meta.checksum == crc32c(0, block->meta.payload, sizeof(block->meta.payload));
+}
+
+// reads metadata block block_num into block and verifies its checksum.
+static bool read_meta_block(FileSystem *fs, uint32_t block_num, union Block *block) {
+    if (!read_from_disk(fs->disk, block_num, block->data)) {
+        return false;
+    }
+
+    if (!block_verify(block)) {
+        fs->counters.checksum_errors++;
+        printf("read_meta_block: checksum mismatch in block %d\n", block_num);
+        return false;
+    }
+
+    return true;
+}
+
+// checksums metadata block and writes it to block_num.
+static bool write_meta_block(FileSystem *fs, uint32_t block_num, union Block *block) {
+    block_seal(block);
+
+    return write_to_disk(fs->disk, block_num, block->data);
+}
+
 bool format(Disk* disk) {
     if (disk->mounted) {
         printf("format: there's a filesystem mounted already on the disk.\n");
         return false;
     }
 
-    // clean any data already presented on disk
-    char zeros[BLOCK_SIZE] = {0};
+    union Block block;
+
+    // clean any data already presented on disk, inode blocks are
+    // written as empty checksummed blocks
+    char *zeros = disk_buffer_get(disk);
+    if (zeros == NULL) {
+        printf("format: failed allocating block buffer\n");
+        return false;
+    }
+
+    memset(zeros, 0, BLOCK_SIZE);
+    memset(block.data, 0, BLOCK_SIZE);
+    block_seal(&block);
+
     for (int i = 0; i < disk->nblocks; i++) {
-        if (!write_to_disk(disk, i, zeros)) {
+        bool inodes = i >= INODES_FIRST_BLOCK && i < DATA_FIRST_BLOCK(disk->nblocks);
+
+        if (!write_to_disk(disk, i, inodes ? block.data : zeros)) {
             printf("format: failed cleaning disk\n"); 
+            disk_buffer_put(disk, zeros);
             return false;
         }
     }
 
-    union Block block;
+    disk_buffer_put(disk, zeros);
 
     // create super block and persist
+    memset(block.data, 0, BLOCK_SIZE);
     block.super.magic_number = MAGIC_NUMBER;
     block.super.nblocks = disk->nblocks;
     block.super.inblocks = NUMBER_OF_INODE_BLOCKS(disk->nblocks);
     block.super.inodes_count = NUMBER_OF_INODE_BLOCKS(disk->nblocks) * INODES_PER_BLOCK;
 
-    if (!write_to_disk(disk, SUPER_BLOCK_OFFSET, block.data)) {
+    block_seal(&block);
+
+    if (!write_to_disk(disk, SUPER_BLOCK_NUMBER, block.data)) {
         printf("format: failed writing super block to disk\n");
         return false;
     }
@@ -34,497 +93,2029 @@ bool format(Disk* disk) {
     return true;
 }
 
-FileSystem* mount_fs(Disk* disk) {
-    union Block block;
-
-    // read super block from disk
-    if (!read_from_disk(disk, SUPER_BLOCK_NUMBER, block.data)) {
-        printf("mount_fs: failed reading super block from disk\n");
-        return NULL;
-    }
-
-    SuperBlock super = block.super;
+// drops a reference just taken by block_ref. unlike block_dealloc the block is never
+// cleaned, since rolled back references were never the block's only ones in use.
+static void block_unref(FileSystem *fs, uint32_t block_num) {
+    fs->block_refs[block_num - DATA_FIRST_BLOCK(fs->super.nblocks)]--;
+}
 
-    // validate magic number
-    if (super.magic_number != MAGIC_NUMBER) {
-        printf("mount_fs: magic number is invalid\n");
-        return NULL;
+// takes a reference to every block the given inode points to. an indirect block's
+// pointers are only followed the first time it is referenced, since they belong to
+// the indirect block and not to the inodes sharing it. on failure the references
+// taken so far are rolled back.
+static bool ref_inode_blocks(FileSystem *fs, const Inode *inode) {
+    int l;
+
+    // scan inode's direct pointers for used blocks
+    for (l = 0; l < POINTERS_PER_INODE; l++) {
+        // block is in-use
+        if (inode->direct[l] != 0 && !block_ref(fs, inode->direct[l])) {
+            goto undo_direct;
+        }
     }
 
-    // create new filesystem
-    FileSystem *fs = (FileSystem*)malloc(sizeof(FileSystem));
-
-    fs->super = super;
-
-    // create bitmap of free inodes
-    fs->free_inodes = (char*)malloc(super.inodes_count * sizeof(char));
-
-    // create bitmap of free blocks
-    fs->free_blocks = (char*)malloc(NUMBER_OF_DATA_BLOCKS(super.nblocks) * sizeof(char));
-    memset(fs->free_blocks, true, NUMBER_OF_DATA_BLOCKS(super.nblocks));
-
-    // iterate over all inode blocks
-    for (int i = 0; i < super.inblocks; i++) {
-        if (!read_from_disk(disk, INODES_FIRST_BLOCK + i, block.data)) {
-            printf("mount_fs: failed reading inodes block from disk\n");
-            return NULL;
+    // scan inode's indirect pointers for used blocks
+    if (inode->indirect != 0) {
+        if (!block_ref(fs, inode->indirect)) {
+            goto undo_direct;
         }
 
-        for (int j = 0; j < INODES_PER_BLOCK; j++) {
-            Inode* inode = &block.inodes[j];
-
-            // scan inode's direct pointers for used blocks
-            for (int l = 0; l < POINTERS_PER_INODE; l++) {
-                // block is in-use
-                if (inode->direct[l] != 0) {
-                    int norm = inode->direct[l] - DATA_FIRST_BLOCK(super.nblocks);
-                    fs->free_blocks[norm] = false;
-                }
-            }
+        if (fs->block_refs[inode->indirect - DATA_FIRST_BLOCK(fs->super.nblocks)] > 1) {
+            return true;
+        }
 
-            // scan inode's indirect pointers for used blocks
-            if (inode->indirect != 0) {
-                int norm = inode->indirect - DATA_FIRST_BLOCK(super.nblocks);
-                fs->free_blocks[norm] = false;
+        union Block indirect_block;
+        if (!read_meta_block(fs, inode->indirect, &indirect_block)) {
+            printf("ref_inode_blocks: failed reading indirect block %d from disk\n", inode->indirect);
+            goto undo_indirect;
+        }
 
-                union Block indirect_block;
-                if (!read_from_disk(disk, inode->indirect, indirect_block.data)) {
-                    printf("mount_fs: failed reading inode %d indirect block from disk\n", j);
-                    return NULL;
-                }
+        fs->counters.indirect_loads++;
 
-                for (int l = 0; l < POINTERS_PER_BLOCK; l++) {
-                    if (indirect_block.pointers[l] != 0) {
-                        int norm = indirect_block.pointers[l] - DATA_FIRST_BLOCK(super.nblocks);
-                        fs->free_blocks[norm] = false;
+        for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+            if (indirect_block.pointers[k] != 0 && !block_ref(fs, indirect_block.pointers[k])) {
+                while (--k >= 0) {
+                    if (indirect_block.pointers[k] != 0) {
+                        block_unref(fs, indirect_block.pointers[k]);
                     }
                 }
-            }
 
-            fs->free_inodes[i * INODES_PER_BLOCK + j] = !inode->valid;
+                goto undo_indirect;
+            }
         }
     }
 
-    mount(disk);
-
-    fs->disk = disk;
+    return true;
 
-    return fs;
-}
+undo_indirect:
+    block_unref(fs, inode->indirect);
 
-ssize_t block_alloc(FileSystem *fs) {
-    for (int i = 0; i < NUMBER_OF_DATA_BLOCKS(fs->super.nblocks); i++) {
-        if (fs->free_blocks[i]) {
-            fs->free_blocks[i] = false;
-            return DATA_FIRST_BLOCK(fs->super.nblocks) + i;
+undo_direct:
+    while (--l >= 0) {
+        if (inode->direct[l] != 0) {
+            block_unref(fs, inode->direct[l]);
         }
     }
 
-    return -1;
+    return false;
 }
 
-bool block_dealloc(FileSystem *fs, int block_num) {
-    char zeros[BLOCK_SIZE] = {0};
-
-    if (!write_to_disk(fs->disk, block_num, zeros)) {
-        printf("block_dealloc: failed deallocating block %d\n", block_num);
-        return false;
+// rolls back the references ref_inode_blocks took for the given inode.
+static void unref_inode_blocks(FileSystem *fs, const Inode *inode) {
+    for (int l = 0; l < POINTERS_PER_INODE; l++) {
+        if (inode->direct[l] != 0) {
+            block_unref(fs, inode->direct[l]);
+        }
     }
 
-    int norm = block_num - DATA_FIRST_BLOCK(fs->super.nblocks);
-    fs->free_blocks[norm] = true;
-
-    return true;
-}
+    if (inode->indirect == 0) {
+        return;
+    }
 
-void free_fs(FileSystem *fs) {
-    fs->disk = NULL;
-    free(fs->free_inodes);
-    free(fs->free_blocks);
-    free(fs);
-}
+    block_unref(fs, inode->indirect);
 
-ssize_t create_inode(FileSystem *fs) {
-    union Block block;
+    // the indirect block's pointers were followed when it was first referenced
+    if (fs->block_refs[inode->indirect - DATA_FIRST_BLOCK(fs->super.nblocks)] > 0) {
+        return;
+    }
 
-    for (int i = 0; i < fs->super.inodes_count; i++) {
-        if(fs->free_inodes[i]) {
-            Inode *inode = load_inode(fs, i, &block);
-            if (inode == NULL) {
-                printf("create_inode: failed loading inode %d\n", i);
-                return -1;
-            }
+    union Block indirect_block;
+    if (!read_meta_block(fs, inode->indirect, &indirect_block)) {
+        printf("unref_inode_blocks: failed reading indirect block %d from disk\n", inode->indirect);
+        return;
+    }
 
-            inode->valid = true;
+    for (int l = 0; l < POINTERS_PER_BLOCK; l++) {
+        if (indirect_block.pointers[l] != 0) {
+            block_unref(fs, indirect_block.pointers[l]);
+        }
+    }
+}
 
-            if (!save_inode(fs, inode, i, &block)) {
-                printf("create_inode: failed saving inode %d\n", i);
-                free(inode);
-                return -1;
+// takes references to the blocks of every inode in the given inode block.
+// on failure the references taken so far are rolled back.
+static bool ref_inodes_block(FileSystem *fs, union Block *block) {
+    for (int j = 0; j < INODES_PER_BLOCK; j++) {
+        if (!ref_inode_blocks(fs, &block->inodes[j])) {
+            while (--j >= 0) {
+                unref_inode_blocks(fs, &block->inodes[j]);
             }
 
-            free(inode);
-            fs->free_inodes[i] = false;
-            return i;
+            return false;
         }
     }
 
-    return -1;
+    return true;
 }
 
-ssize_t stat_inode(FileSystem *fs, size_t inode_num) {
-    union Block block;
-    ssize_t size = 0;
+// a snapshot's chain of descriptor blocks, loaded into memory.
+typedef struct SnapshotDescs {
 
-    Inode *inode = load_inode(fs, inode_num, &block);
-    if (inode == NULL) {
-        printf("stat: failed to load inode\n");
-        return -1;
-    }
+    // number of descriptor blocks, enough for all the inode blocks
+    int count;
 
-    size = inode->size;
+    // the descriptor blocks, in chain order
+    union Block *blocks;
 
-    free(inode);
+    // block numbers of the descriptor blocks
+    uint32_t *ptrs;
 
-    return size;
-}
+} SnapshotDescs;
 
-bool remove_inode(FileSystem *fs, size_t inode_num) {
-    if (inode_num < 0 || inode_num > fs->super.inodes_count) {
-        return false;
-    }
+// returns the pointer to the copy of inode block i of a snapshot.
+static uint32_t *snapshot_copy(SnapshotDescs *descs, size_t i) {
+    return &descs->blocks[i / SNAPSHOT_DESC_POINTERS].pointers[i % SNAPSHOT_DESC_POINTERS];
+}
 
-    if (fs->free_inodes[inode_num]) {
-        return true; // idempotent
-    }
+static bool snapshot_descs_alloc(FileSystem *fs, SnapshotDescs *descs) {
+    descs->count = fs->super.inblocks ? (fs->super.inblocks + SNAPSHOT_DESC_POINTERS - 1) / SNAPSHOT_DESC_POINTERS : 1;
+    descs->blocks = (union Block*)aligned_alloc(sizeof(union Block), descs->count * sizeof(union Block));
+    descs->ptrs = (uint32_t*)calloc(descs->count, sizeof(uint32_t));
 
-    union Block inodes_block;
-    Inode* inode = load_inode(fs, inode_num, &inodes_block);
-    if (inode == NULL) {
-        printf("load_inode: failed to load inode %ld into memory\n", inode_num);
+    if (descs->blocks == NULL || descs->ptrs == NULL) {
+        printf("snapshot: failed allocating %d descriptor blocks\n", descs->count);
+        free(descs->blocks);
+        free(descs->ptrs);
         return false;
     }
 
-    // free direct pointers if any
-    for (int i = 0; i < POINTERS_PER_INODE; i++) {
-        if (inode->direct[i] != 0) {
-            if (!block_dealloc(fs, inode->direct[i])) {
-                printf("remove_inode: failed cleaning block %d for inode %ld\n", inode->direct[i], inode_num);
-                free(inode);
-                return false;
-            }
+    memset(descs->blocks, 0, descs->count * sizeof(union Block));
 
-            inode->direct[i] = 0;
-        }
-    }
+    return true;
+}
 
-    // free indirect pointer and indirect blocks if any
-    if (inode->indirect != 0) {
-        union Block indirect_block; 
+static void snapshot_descs_free(SnapshotDescs *descs) {
+    free(descs->blocks);
+    free(descs->ptrs);
+}
 
-        if (!read_from_disk(fs->disk, inode->indirect, indirect_block.data)) {
-            printf("remove_inode: failed reading indirect block for inode %ld\n", inode_num);
-            free(inode);
-            return false;
-        }
+// allocates descs and reads the chain of descriptor blocks starting at head into it.
+static bool snapshot_descs_load(FileSystem *fs, uint32_t head, SnapshotDescs *descs) {
+    if (!snapshot_descs_alloc(fs, descs)) {
+        return false;
+    }
 
-        for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
-            if (indirect_block.pointers[i] != 0) { // free indirect blocks
-                if (!block_dealloc(fs, indirect_block.pointers[i])) {
-                    printf("remove_inode: failed cleaning block %d for inode %ld\n", indirect_block.pointers[i], inode_num);
-                    free(inode);
-                    return false;
-                }
-            }
-        }
+    uint32_t ptr = head;
 
-        // free indirect block
-        if (!block_dealloc(fs, inode->indirect)) {
-            printf("remove_inode: failed cleaning block %d for inode %ld\n", inode->indirect, inode_num);
-            free(inode);
+    for (int k = 0; k < descs->count; k++) {
+        if (ptr == 0 || !read_meta_block(fs, ptr, &descs->blocks[k])) {
+            printf("snapshot: failed reading snapshot descriptor %d\n", ptr);
+            snapshot_descs_free(descs);
             return false;
         }
 
-        inode->indirect = 0;
+        descs->ptrs[k] = ptr;
+        ptr = descs->blocks[k].pointers[SNAPSHOT_DESC_NEXT];
     }
 
-    inode->size = 0;
-    inode->valid = 0;
+    return true;
+}
 
-    if (!save_inode(fs, inode, inode_num, &inodes_block)) {
-        printf("remove_inode: failed saving inode %ld on disk\n", inode_num);
+// takes references to a snapshot's descriptor and inode blocks and to the blocks its inodes point to.
+static bool ref_snapshot(FileSystem *fs, uint32_t head) {
+    SnapshotDescs descs;
+    union Block block;
+    bool ok = true;
+
+    if (!snapshot_descs_load(fs, head, &descs)) {
+        printf("mount_fs: failed loading snapshot descriptors at %d\n", head);
         return false;
     }
 
-    fs->free_inodes[inode_num] = true;
+    for (int k = 0; ok && k < descs.count; k++) {
+        ok = block_ref(fs, descs.ptrs[k]);
+    }
 
-    free(inode);
+    for (int i = 0; ok && i < fs->super.inblocks; i++) {
+        uint32_t copy = *snapshot_copy(&descs, i);
 
-    return true;
-}
+        if (!block_ref(fs, copy) || !read_meta_block(fs, copy, &block)) {
+            printf("mount_fs: failed loading snapshot inodes block %d\n", copy);
+            ok = false;
+            break;
+        }
 
-Inode* load_inode(FileSystem *fs, size_t inode_num, union Block *block) {
-    if (!read_from_disk(fs->disk, INODE_BLOCK(inode_num), block->data)) {
-        printf("load_inode: failed to load inodes block for inode %ld\n", inode_num);
-        return NULL;
+        ok = ref_inodes_block(fs, &block);
     }
 
-    Inode inode = block->inodes[INODE_OFFSET_IN_BLOCK(inode_num)];
-
-    Inode* new_inode = (Inode*)malloc(sizeof(Inode));
-    memcpy(new_inode, &inode, sizeof(inode));
+    snapshot_descs_free(&descs);
 
-    return new_inode;
+    return ok;
 }
 
-bool save_inode(FileSystem *fs, Inode *inode, size_t inode_num, union Block *block) {
-   block->inodes[INODE_OFFSET_IN_BLOCK(inode_num)] = *inode;
-   
-   if (!write_to_disk(fs->disk, INODE_BLOCK(inode_num), block->data)) {
-        printf("save_inode: failed to save inode's block for inode %ld\n", inode_num);
-        return false;
-   }
+// one thread's share of an inode table scan.
+typedef struct InodeScan {
 
-   return true;
-}
+    FileSystem *fs;
 
-ssize_t read_from_inode(FileSystem *fs, size_t inode_num, char *data, size_t length, size_t offset) {
-    union Block block;
+    // inode blocks [first, end) of the inode table to scan
+    size_t first;
+    size_t end;
 
-    Inode *inode = load_inode(fs, inode_num, &block);
-    if (inode == NULL) {
-        printf("read_from_inode: failed to load inode %ld\n", inode_num);
-        return -1;
-    }
+    InodeBatchFn fn;
+    void *arg;
 
-    if (!inode->valid) {
-        printf("read_from_inode: inode %ld is invalid\n", inode_num);
-        free(inode);
-        return -1;
-    }
+    // shared by all threads of the scan, set once any of them fails or fn stops the iteration
+    bool *stop;
 
-    if (offset >= inode->size) {
-        printf("read_from_inode: inode %ld size is less than the given offset %ld\n", inode_num, offset);
-        free(inode);
-        return -1;
-    }
+    // counters merged into the filesystem's and the disk's once the scan is done
+    uint64_t blocks;
+    uint64_t checksum_errors;
+    IoStats io;
 
-    // fix length in case we surpass the inode's size
-    if (offset + length >= inode->size) {
-        length = inode->size - offset;
-    }
-   
-    size_t starting_block = offset / BLOCK_SIZE;
-    size_t ending_block = (offset + length) / BLOCK_SIZE;
-    size_t current_block = starting_block;
-    ssize_t n = 0;
-    union Block indirect_block;
-    bool loaded = false;
+    bool ok;
 
-    while (current_block <= ending_block) {
-        uint32_t bp = 0;
-        size_t off = 0;
-        size_t s = 0;
+    pthread_t thread;
+    bool threaded;
 
-        if (current_block < POINTERS_PER_INODE) {
-            bp = inode->direct[current_block];
-        } else {
-            if (!loaded) {
-                // if inode's indirect block is not allocated,
-                // then we know we've read all we can from this inode
-                if (!inode->indirect) {
-                    break;
-                }
+} InodeScan;
 
-                // load indirect block only once
-                if (!read_from_disk(fs->disk, inode->indirect, indirect_block.data)) {
-                    printf("read_from_inode: failed reading indirect block\n");
-                    free(inode);
-                    return -1;
-                }
+static void *scan_inode_blocks(void *arg) {
+    InodeScan *scan = (InodeScan*)arg;
+    Disk *disk = scan->fs->disk;
+    DiskIo ios[INODE_SCAN_BLOCKS];
 
-                loaded = true;
-            }
+    union Block *chunk = (union Block*)aligned_alloc(sizeof(union Block), INODE_SCAN_BLOCKS * sizeof(union Block));
+    if (chunk == NULL) {
+        printf("for_each_inode: failed allocating inode blocks buffer\n");
+        scan->ok = false;
+        __atomic_store_n(scan->stop, true, __ATOMIC_RELAXED);
+        return NULL;
+    }
 
-            if (current_block - POINTERS_PER_INODE >= POINTERS_PER_BLOCK) {
-                printf("read_from_inode: trying to read from an out of bounds pointer in indirect block for inode %ld\n", inode_num);
-                break;
-            }
+    scan->ok = true;
 
-            bp = indirect_block.pointers[current_block - POINTERS_PER_INODE];
+    for (size_t b = scan->first, n; b < scan->end; b += n) {
+        if (__atomic_load_n(scan->stop, __ATOMIC_RELAXED)) {
+            scan->ok = false;
+            break;
         }
 
-        // if current block is not allocated,
-        // skip to the next one. in case of a sparse file 
-        // this unallocated block should be treated as a block filled with zeros
-        // and be copied on the fly to the caller's buffer. 
-        // this is not implemented currently.
-        if (!bp) {
-            current_block++;
-            continue;
-        }
+        n = scan->end - b < INODE_SCAN_BLOCKS ? scan->end - b : INODE_SCAN_BLOCKS;
 
-        if (!read_from_disk(fs->disk, bp, block.data)) {
-            printf("read_from_inode: failed reading block of inode %ld", inode_num);
-            free(inode);
-            return -1;
+        // have the next chunk read ahead while this one is read and handed out
+        if (b + n < scan->end) {
+            size_t next = scan->end - b - n < INODE_SCAN_BLOCKS ? scan->end - b - n : INODE_SCAN_BLOCKS;
+            disk_prefetch(disk, INODES_FIRST_BLOCK + b + n, next);
         }
 
-        s = BLOCK_SIZE <= length ? BLOCK_SIZE : length;
-        off = current_block == starting_block ? offset % BLOCK_SIZE : 0;
+        for (size_t i = 0; i < n; i++) {
+            ios[i].blocknum = INODES_FIRST_BLOCK + b + i;
+            ios[i].buff = chunk[i].data;
+            ios[i].write = false;
+        }
 
-        // adjust s in case we overflow from the current block
-        s = s + off >= BLOCK_SIZE ? BLOCK_SIZE - off : s;
+        // the chunk is aligned and the stats are the thread's own, so no lock is needed
+        if (!disk_submit_with(disk, ios, n, &scan->io)) {
+            printf("for_each_inode: failed reading inode blocks %ld-%ld\n", INODES_FIRST_BLOCK + b, INODES_FIRST_BLOCK + b + n - 1);
+            scan->ok = false;
+            break;
+        }
 
-        memcpy(data + n, block.data + off, s);
+        for (size_t i = 0; i < n && scan->ok; i++) {
+            if (!block_verify(&chunk[i])) {
+                scan->checksum_errors++;
+                printf("for_each_inode: checksum mismatch in block %ld\n", INODES_FIRST_BLOCK + b + i);
+                scan->ok = false;
+                break;
+            }
 
-        n += s;
-        length -= s;
-        current_block++;
-    }
+            scan->blocks++;
 
-    return n;
-}
+            InodeBatch batch = {
+                .first_inode = (b + i) * INODES_PER_BLOCK,
+                .count = INODES_PER_BLOCK,
+                .inodes = chunk[i].inodes,
+            };
 
-// TODO: update inode's size upon writing
-ssize_t write_to_inode(FileSystem *fs, size_t inode_num, char *data, size_t length, size_t offset) {
-    union Block inode_block;
+            scan->ok = scan->fn(&batch, scan->arg);
+        }
 
-    Inode *inode = load_inode(fs, inode_num, &inode_block);
-    if (inode == NULL) {
-        printf("write_to_inode: failed loading inode %ld\n", inode_num);
-        return -1;
+        if (!scan->ok) {
+            break;
+        }
     }
 
-    if (!inode->valid) {
-        printf("write_to_inode: inode %ld is invalid\n", inode_num);
-        free(inode);
-        return -1;
+    if (!scan->ok) {
+        __atomic_store_n(scan->stop, true, __ATOMIC_RELAXED);
     }
 
-    size_t starting_block = offset / BLOCK_SIZE;
-    size_t ending_block = (offset + length) / BLOCK_SIZE;
-    size_t current_block = starting_block;
-    size_t n = 0;
-   //uint32_t new_size = inode->size;
-    bool loaded = false;
-    bool inode_modified = false;
-    bool indirect_modified = false;
-    union Block indirect_block;
+    free(chunk);
 
-    while (current_block <= ending_block) {
-        union Block cb;
-        ssize_t block_ptr = 0;
-        uint32_t bp = 0;
-        size_t off = 0;
-        size_t s = 0;
+    return NULL;
+}
 
-        if (current_block < POINTERS_PER_INODE) {
-            if (!inode->direct[current_block]) {
-                block_ptr = block_alloc(fs);
-                if (block_ptr == -1) {
-                    printf("write_to_inode: disk is full\n");
-                    break;
-                }
+// calls fn with the inodes of inode blocks [first, end), splitting them between nthreads threads.
+static bool scan_inodes(FileSystem *fs, size_t first, size_t end, InodeBatchFn fn, void *arg, int nthreads) {
+    bool stop = false;
+    bool ok = true;
 
-                inode->direct[current_block] = block_ptr;
-                inode->size += BLOCK_SIZE;
-                inode_modified = true;
-            }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
 
-            bp = inode->direct[current_block] = block_ptr;
-        } else {
-            if (!inode->indirect) {
-                // indirect node is not allocated
-                block_ptr = block_alloc(fs);
-                if (block_ptr == -1) {
-                    printf("write_to_inode: disk is full\n");
-                    break;
-                }
+    if (nthreads > end - first) {
+        nthreads = end - first ? end - first : 1;
+    }
 
-                inode->indirect = block_ptr;
-                inode_modified = true;
-            } 
-            
-            if (!loaded) {
-                // load indirect node to memory
-                if (!read_from_disk(fs->disk, inode->indirect, indirect_block.data)) {
-                    printf("write_to_inode: failed reading indirect block\n");
-                    free(inode);
-                    return -1;
-                }
+    InodeScan *scans = (InodeScan*)calloc(nthreads, sizeof(InodeScan));
+    if (scans == NULL) {
+        printf("for_each_inode: failed allocating scans\n");
+        return false;
+    }
 
-                loaded = true;
-            }
+    size_t per_thread = (end - first + nthreads - 1) / nthreads;
 
-            if (current_block - POINTERS_PER_INODE >= POINTERS_PER_BLOCK) {
-                printf("write_to_inode: trying to write to an out of bounds pointer in indirect block for inode %ld\n", inode_num);
-                break;    
-            }
+    for (int t = 0; t < nthreads; t++) {
+        InodeScan *scan = &scans[t];
 
-            if (!indirect_block.pointers[current_block - POINTERS_PER_INODE]) {
-                block_ptr = block_alloc(fs);
-                if (block_ptr == -1) {
-                    printf("write_to_inode: disk is full\n");
-                    break;
-                }
+        scan->fs = fs;
+        scan->first = first + t * per_thread < end ? first + t * per_thread : end;
+        scan->end = scan->first + per_thread < end ? scan->first + per_thread : end;
+        scan->fn = fn;
+        scan->arg = arg;
+        scan->stop = &stop;
 
-                indirect_block.pointers[current_block - POINTERS_PER_INODE] = block_ptr;
-                inode->size += BLOCK_SIZE;
-                indirect_modified = true;
-            }          
-            
-            bp = indirect_block.pointers[current_block - POINTERS_PER_INODE];
+        // the calling thread scans the first share itself
+        if (t > 0) {
+            scan->threaded = pthread_create(&scan->thread, NULL, scan_inode_blocks, scan) == 0;
+            if (!scan->threaded) {
+                scan_inode_blocks(scan);
+            }
         }
+    }
 
-        s = BLOCK_SIZE <= length ? BLOCK_SIZE : length;
-        off = current_block == starting_block ? offset % BLOCK_SIZE : 0;
+    scan_inode_blocks(&scans[0]);
 
-        // adjust s in case we overflow from the current block
-        s = s + off >= BLOCK_SIZE ? BLOCK_SIZE - off : s;
+    for (int t = 0; t < nthreads; t++) {
+        if (scans[t].threaded) {
+            pthread_join(scans[t].thread, NULL);
+        }
 
-        char *b = data + n;
+        fs->counters.inode_scan_blocks += scans[t].blocks;
+        fs->counters.checksum_errors += scans[t].checksum_errors;
+        io_stats_merge(&fs->disk->stats, &scans[t].io);
+        ok &= scans[t].ok;
+    }
 
-        if (off > 0 || s < BLOCK_SIZE) {
-            // perform read-modify-write in cases where we want to update only a part
-            // of a data block. caused by the fact that we only operate with BLOCK_SIZE granularity
-            if (!read_from_disk(fs->disk, bp, cb.data)) {
-                printf("write_to_inode: failed reading data block of inode %ld\n", inode_num);
-                free(inode);
-                return -1;
-            }
+    free(scans);
 
-            memcpy(cb.data + off, data + n, s);
+    return ok;
+}
 
-            b = cb.data;
+// takes references to the blocks of a batch of inodes and records which of them are free.
+static bool mount_inodes(const InodeBatch *batch, void *arg) {
+    FileSystem *fs = (FileSystem*)arg;
+
+    for (size_t j = 0; j < batch->count; j++) {
+        if (!ref_inode_blocks(fs, &batch->inodes[j])) {
+            printf("mount_fs: failed scanning inode %ld\n", batch->first_inode + j);
+            return false;
+        }
+
+        fs->free_inodes[batch->first_inode + j] = !batch->inodes[j].valid;
+    }
+
+    return true;
+}
+
+FileSystem* mount_fs(Disk* disk) {
+    union Block block;
+
+    // read super block from disk
+    if (!read_from_disk(disk, SUPER_BLOCK_NUMBER, block.data)) {
+        printf("mount_fs: failed reading super block from disk\n");
+        return NULL;
+    }
+
+    SuperBlock super = block.super;
+
+    // validate magic number
+    if (super.magic_number != MAGIC_NUMBER) {
+        printf("mount_fs: magic number is invalid\n");
+        return NULL;
+    }
+
+    if (!block_verify(&block)) {
+        printf("mount_fs: super block checksum mismatch\n");
+        return NULL;
+    }
+
+    // create new filesystem
+    FileSystem *fs = (FileSystem*)calloc(1, sizeof(FileSystem));
+
+    fs->super = super;
+    fs->disk = disk;
+
+    // create bitmap of free inodes
+    fs->free_inodes = (char*)malloc(super.inodes_count * sizeof(char));
+
+    // create reference counts of data blocks, all blocks start out free
+    fs->block_refs = (uint16_t*)calloc(NUMBER_OF_DATA_BLOCKS(super.nblocks), sizeof(uint16_t));
+
+    // scan all inode blocks. single threaded, since references are taken on a shared table
+    if (!scan_inodes(fs, 0, super.inblocks, mount_inodes, fs, 1)) {
+        printf("mount_fs: failed scanning inodes table\n");
+        free_fs(fs);
+        return NULL;
+    }
+
+    // snapshots hold references to the blocks they share with the live tree
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (super.snapshots[i] != 0 && !ref_snapshot(fs, super.snapshots[i])) {
+            printf("mount_fs: failed scanning snapshot %d\n", i);
+            free_fs(fs);
+            return NULL;
+        }
+    }
+
+    mount(disk);
+
+    return fs;
+}
+
+ssize_t block_alloc(FileSystem *fs) {
+    int i;
+
+    for (i = 0; i < NUMBER_OF_DATA_BLOCKS(fs->super.nblocks); i++) {
+        if (!fs->block_refs[i]) {
+            fs->block_refs[i] = 1;
+            fs->counters.block_allocs++;
+            histogram_record(&fs->counters.alloc_scan, i + 1);
+            return DATA_FIRST_BLOCK(fs->super.nblocks) + i;
+        }
+    }
+
+    fs->counters.alloc_failures++;
+    histogram_record(&fs->counters.alloc_scan, i);
+
+    return -1;
+}
+
+bool block_ref(FileSystem *fs, int block_num) {
+    int norm = block_num - DATA_FIRST_BLOCK(fs->super.nblocks);
+
+    if (norm < 0 || norm >= NUMBER_OF_DATA_BLOCKS(fs->super.nblocks) || fs->block_refs[norm] == MAX_BLOCK_REFS) {
+        printf("block_ref: can't reference block %d\n", block_num);
+        return false;
+    }
+
+    fs->block_refs[norm]++;
+
+    return true;
+}
+
+bool block_dealloc(FileSystem *fs, int block_num) {
+    int norm = block_num - DATA_FIRST_BLOCK(fs->super.nblocks);
+
+    // block is still shared, only drop this reference
+    if (fs->block_refs[norm] > 1) {
+        fs->block_refs[norm]--;
+        return true;
+    }
+
+    char *zeros = disk_buffer_get(fs->disk);
+    if (zeros == NULL) {
+        printf("block_dealloc: failed allocating block buffer\n");
+        return false;
+    }
+
+    memset(zeros, 0, BLOCK_SIZE);
+
+    bool ok = write_to_disk(fs->disk, block_num, zeros);
+
+    disk_buffer_put(fs->disk, zeros);
+
+    if (!ok) {
+        printf("block_dealloc: failed deallocating block %d\n", block_num);
+        return false;
+    }
+
+    fs->block_refs[norm] = 0;
+    fs->counters.block_deallocs++;
+
+    return true;
+}
+
+void free_fs(FileSystem *fs) {
+    fs->disk = NULL;
+    free(fs->free_inodes);
+    free(fs->block_refs);
+    free(fs);
+}
+
+void fs_get_stats(FileSystem *fs, FsStats *stats) {
+    stats->io = fs->disk->stats;
+    stats->io.pool_overflows = fs->disk->pool->overflows;
+    stats->fs = fs->counters;
+}
+
+void fs_dump_stats(FileSystem *fs, FILE *out) {
+    FsStats stats;
+    fs_get_stats(fs, &stats);
+
+    fprintf(out, "simplefs stats:\n");
+    fprintf(out, "  ops=%llu\n", (unsigned long long)stats.fs.ops);
+    fprintf(out, "  block reads=%llu writes=%llu read_errors=%llu write_errors=%llu\n",
+            (unsigned long long)stats.io.reads, (unsigned long long)stats.io.writes,
+            (unsigned long long)stats.io.read_errors, (unsigned long long)stats.io.write_errors);
+    fprintf(out, "  direct_io_bounces=%llu pool_overflows=%llu\n",
+            (unsigned long long)stats.io.bounces, (unsigned long long)stats.io.pool_overflows);
+    histogram_dump(&stats.io.read_latency, "read latency", "ns", out);
+    histogram_dump(&stats.io.write_latency, "write latency", "ns", out);
+    fprintf(out, "  block allocs=%llu alloc_failures=%llu deallocs=%llu\n",
+            (unsigned long long)stats.fs.block_allocs, (unsigned long long)stats.fs.alloc_failures,
+            (unsigned long long)stats.fs.block_deallocs);
+    histogram_dump(&stats.fs.alloc_scan, "alloc scan length", "", out);
+    fprintf(out, "  inode loads=%llu saves=%llu indirect_loads=%llu rmw_writes=%llu\n",
+            (unsigned long long)stats.fs.inode_loads, (unsigned long long)stats.fs.inode_saves,
+            (unsigned long long)stats.fs.indirect_loads, (unsigned long long)stats.fs.rmw_writes);
+    fprintf(out, "  checksum_errors=%llu inode_scan_blocks=%llu\n",
+            (unsigned long long)stats.fs.checksum_errors, (unsigned long long)stats.fs.inode_scan_blocks);
+}
+
+void fs_set_stats_dump(FileSystem *fs, FILE *out, uint64_t every) {
+    fs->stats_out = out;
+    fs->stats_every = out ? every : 0;
+}
+
+ssize_t create_inode(FileSystem *fs) {
+    for (int i = 0; i < fs->super.inodes_count; i++) {
+        if(fs->free_inodes[i]) {
+            return create_inode_at(fs, i) ? i : -1;
+        }
+    }
+
+    return -1;
+}
+
+bool create_inode_at(FileSystem *fs, size_t inode_num) {
+    union Block block;
+
+    fs_stats_tick(fs);
+
+    if (inode_num >= fs->super.inodes_count || !fs->free_inodes[inode_num]) {
+        return false;
+    }
+
+    Inode *inode = load_inode(fs, inode_num, &block);
+    if (inode == NULL) {
+        printf("create_inode: failed loading inode %ld\n", inode_num);
+        return false;
+    }
+
+    inode->valid = true;
+
+    if (!save_inode(fs, inode, inode_num, &block)) {
+        printf("create_inode: failed saving inode %ld\n", inode_num);
+        free(inode);
+        return false;
+    }
+
+    free(inode);
+    fs->free_inodes[inode_num] = false;
+
+    return true;
+}
+
+ssize_t stat_inode(FileSystem *fs, size_t inode_num) {
+    union Block block;
+    ssize_t size = 0;
+
+    fs_stats_tick(fs);
+
+    Inode *inode = load_inode(fs, inode_num, &block);
+    if (inode == NULL) {
+        printf("stat: failed to load inode\n");
+        return -1;
+    }
+
+    size = inode->size;
+
+    free(inode);
+
+    return size;
+}
+
+bool for_each_inode(FileSystem *fs, InodeBatchFn fn, void *arg, int nthreads) {
+    fs_stats_tick(fs);
+
+    return scan_inodes(fs, 0, fs->super.inblocks, fn, arg, nthreads);
+}
+
+typedef struct BulkStat {
+
+    // inodes [first_inode, end) are reported into sizes
+    size_t first_inode;
+    size_t end;
+    ssize_t *sizes;
+
+} BulkStat;
+
+static bool bulk_stat_inodes(const InodeBatch *batch, void *arg) {
+    BulkStat *bs = (BulkStat*)arg;
+
+    for (size_t j = 0; j < batch->count; j++) {
+        size_t inode_num = batch->first_inode + j;
+
+        if (inode_num >= bs->first_inode && inode_num < bs->end) {
+            bs->sizes[inode_num - bs->first_inode] = batch->inodes[j].valid ? (ssize_t)batch->inodes[j].size : -1;
+        }
+    }
+
+    return true;
+}
+
+ssize_t bulk_stat(FileSystem *fs, size_t first_inode, size_t count, ssize_t *sizes) {
+    fs_stats_tick(fs);
+
+    if (first_inode >= fs->super.inodes_count) {
+        printf("bulk_stat: inode %ld is out of range\n", first_inode);
+        return -1;
+    }
+
+    if (count > fs->super.inodes_count - first_inode) {
+        count = fs->super.inodes_count - first_inode;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    BulkStat bs = {
+        .first_inode = first_inode,
+        .end = first_inode + count,
+        .sizes = sizes,
+    };
+
+    if (!scan_inodes(fs, first_inode / INODES_PER_BLOCK, (bs.end - 1) / INODES_PER_BLOCK + 1, bulk_stat_inodes, &bs, 1)) {
+        printf("bulk_stat: failed scanning inodes %ld-%ld\n", first_inode, bs.end - 1);
+        return -1;
+    }
+
+    return count;
+}
+
+// drops the inode's references to its data blocks from the direct pointer first_direct on,
+// and to its indirect block, and clears the pointers. the blocks behind a shared indirect block
+// still belong to it, so they are only released together with the indirect block's last reference.
+static bool release_inode_blocks_from(FileSystem *fs, Inode *inode, size_t inode_num, int first_direct) {
+    // free direct pointers if any
+    for (int i = first_direct; i < POINTERS_PER_INODE; i++) {
+        if (inode->direct[i] != 0) {
+            if (!block_dealloc(fs, inode->direct[i])) {
+                printf("remove_inode: failed cleaning block %d for inode %ld\n", inode->direct[i], inode_num);
+                return false;
+            }
+
+            inode->direct[i] = 0;
+        }
+    }
+
+    // free indirect pointer and indirect blocks if any
+    if (inode->indirect != 0) {
+        if (fs->block_refs[inode->indirect - DATA_FIRST_BLOCK(fs->super.nblocks)] == 1) {
+            union Block indirect_block;
+
+            if (!read_meta_block(fs, inode->indirect, &indirect_block)) {
+                printf("remove_inode: failed reading indirect block for inode %ld\n", inode_num);
+                return false;
+            }
+
+            fs->counters.indirect_loads++;
+
+            for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
+                if (indirect_block.pointers[i] != 0) { // free indirect blocks
+                    if (!block_dealloc(fs, indirect_block.pointers[i])) {
+                        printf("remove_inode: failed cleaning block %d for inode %ld\n", indirect_block.pointers[i], inode_num);
+                        return false;
+                    }
+                }
+            }
+        }
+
+        // free indirect block
+        if (!block_dealloc(fs, inode->indirect)) {
+            printf("remove_inode: failed cleaning block %d for inode %ld\n", inode->indirect, inode_num);
+            return false;
+        }
+
+        inode->indirect = 0;
+    }
+
+    return true;
+}
+
+static bool release_inode_blocks(FileSystem *fs, Inode *inode, size_t inode_num) {
+    return release_inode_blocks_from(fs, inode, inode_num, 0);
+}
+
+
+bool remove_inode(FileSystem *fs, size_t inode_num) {
+    fs_stats_tick(fs);
+
+    if (inode_num < 0 || inode_num > fs->super.inodes_count) {
+        return false;
+    }
+
+    if (fs->free_inodes[inode_num]) {
+        return true; // idempotent
+    }
+
+    union Block inodes_block;
+    Inode* inode = load_inode(fs, inode_num, &inodes_block);
+    if (inode == NULL) {
+        printf("load_inode: failed to load inode %ld into memory\n", inode_num);
+        return false;
+    }
+
+    if (!release_inode_blocks(fs, inode, inode_num)) {
+        free(inode);
+        return false;
+    }
+
+    inode->size = 0;
+    inode->valid = 0;
+
+    if (!save_inode(fs, inode, inode_num, &inodes_block)) {
+        printf("remove_inode: failed saving inode %ld on disk\n", inode_num);
+        return false;
+    }
+
+    fs->free_inodes[inode_num] = true;
+
+    free(inode);
+
+    return true;
+}
+
+Inode* load_inode(FileSystem *fs, size_t inode_num, union Block *block) {
+    if (!read_meta_block(fs, INODE_BLOCK(inode_num), block)) {
+        printf("load_inode: failed to load inodes block for inode %ld\n", inode_num);
+        return NULL;
+    }
+
+    fs->counters.inode_loads++;
+
+    Inode inode = block->inodes[INODE_OFFSET_IN_BLOCK(inode_num)];
+
+    Inode* new_inode = (Inode*)malloc(sizeof(Inode));
+    memcpy(new_inode, &inode, sizeof(inode));
+
+    return new_inode;
+}
+
+bool save_inode(FileSystem *fs, Inode *inode, size_t inode_num, union Block *block) {
+   block->inodes[INODE_OFFSET_IN_BLOCK(inode_num)] = *inode;
+   
+   if (!write_meta_block(fs, INODE_BLOCK(inode_num), block)) {
+        printf("save_inode: failed to save inode's block for inode %ld\n", inode_num);
+        return false;
+   }
+
+   fs->counters.inode_saves++;
+
+   return true;
+}
+
+// an inode loaded once for all of a batch's operations on it.
+typedef struct InodeHandle {
+
+    size_t inode_num;
+
+    Inode inode;
+
+    // the inode's indirect block, loaded on first use
+    union Block indirect_block;
+
+    // the inode block the inode was loaded from, written back with the modified inodes
+    union Block *inode_block;
+
+    // whether the inode could be loaded
+    bool loaded;
+
+    bool indirect_loaded;
+    bool inode_modified;
+    bool indirect_modified;
+
+} InodeHandle;
+
+// a piece of an operation that transfers bytes between one disk block and a caller's buffer.
+typedef struct Segment {
+
+    // disk block the bytes are transferred to / from
+    uint32_t block;
+
+    // block holding the content the block had before this write, 0 for a new (zeroed) block.
+    // differs from block when a shared block was copied on write.
+    uint32_t src;
+
+    // byte range inside the block
+    uint32_t off;
+    uint32_t len;
+
+    char *buff;
+
+    // order in which segments were resolved, segments of the same block are applied in this order
+    size_t seq;
+
+    // index of the operation the segment belongs to
+    size_t op;
+
+    bool write;
+
+} Segment;
+
+typedef struct Batch {
+    Segment *segs;
+    size_t count;
+    size_t cap;
+} Batch;
+
+// results of handle_block besides a block number
+#define BLOCK_HOLE 0
+#define BLOCK_STOP -1
+#define BLOCK_ERROR -2
+
+// returns a block that can be written in place of block bp. a block that is shared with
+// a snapshot or a clone is replaced by a newly allocated one, and bp's reference is dropped.
+// the caller is responsible for copying the content. returns -1 if the disk is full.
+static ssize_t block_cow(FileSystem *fs, uint32_t bp) {
+    if (fs->block_refs[bp - DATA_FIRST_BLOCK(fs->super.nblocks)] == 1) {
+        return bp;
+    }
+
+    ssize_t block_ptr = block_alloc(fs);
+    if (block_ptr == -1) {
+        return -1;
+    }
+
+    // still referenced by someone else, so this only drops the count
+    block_dealloc(fs, bp);
+
+    return block_ptr;
+}
+
+// replaces the shared indirect block bp, already loaded into indirect_block, with a private copy.
+// the copy points to the same data blocks, which gain a reference each.
+// returns the new indirect block, which the caller must write, or -1 on failure.
+static ssize_t indirect_cow(FileSystem *fs, uint32_t bp, union Block *indirect_block) {
+    ssize_t block_ptr = block_alloc(fs);
+    if (block_ptr == -1) {
+        return -1;
+    }
+
+    for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
+        if (indirect_block->pointers[i] != 0 && !block_ref(fs, indirect_block->pointers[i])) {
+            // roll back the references taken so far
+            while (--i >= 0) {
+                if (indirect_block->pointers[i] != 0) {
+                    block_dealloc(fs, indirect_block->pointers[i]);
+                }
+            }
+
+            block_dealloc(fs, block_ptr);
+            return -1;
+        }
+    }
+
+    block_dealloc(fs, bp);
+
+    return block_ptr;
+}
+
+// resolves logical block current_block of the handle's inode into a disk block.
+// for writes (write = true) missing blocks are allocated and shared blocks are copied on
+// write, *src is set to the block holding the previous content (0 for a new block).
+// returns the block, BLOCK_HOLE for an unallocated block, BLOCK_STOP when nothing past this
+// block can be transferred and BLOCK_ERROR on I/O failure.
+static ssize_t handle_block(FileSystem *fs, InodeHandle *h, size_t current_block, bool write, uint32_t *src) {
+    const char *who = write ? "write_to_inode" : "read_from_inode";
+    Inode *inode = &h->inode;
+    ssize_t block_ptr;
+    uint32_t *ptr;
+
+    *src = 0;
+
+    if (current_block < POINTERS_PER_INODE) {
+        ptr = &inode->direct[current_block];
+    } else {
+        if (current_block - POINTERS_PER_INODE >= POINTERS_PER_BLOCK) {
+            printf("%s: trying to access an out of bounds pointer in indirect block for inode %ld\n", who, h->inode_num);
+            return BLOCK_STOP;
+        }
+
+        if (!inode->indirect) {
+            // none of the blocks behind an unallocated indirect block are allocated
+            if (!write) {
+                return BLOCK_HOLE;
+            }
+
+            // indirect node is not allocated
+            block_ptr = block_alloc(fs);
+            if (block_ptr == -1) {
+                printf("write_to_inode: disk is full\n");
+                return BLOCK_STOP;
+            }
+
+            inode->indirect = block_ptr;
+            h->inode_modified = true;
+
+            // a new indirect block starts out empty, there's nothing to load
+            memset(h->indirect_block.data, 0, BLOCK_SIZE);
+            h->indirect_loaded = true;
+            h->indirect_modified = true;
+        }
+
+        if (!h->indirect_loaded) {
+            // load indirect block only once per batch
+            if (!read_meta_block(fs, inode->indirect, &h->indirect_block)) {
+                printf("%s: failed reading indirect block\n", who);
+                return BLOCK_ERROR;
+            }
+
+            fs->counters.indirect_loads++;
+            h->indirect_loaded = true;
+        }
+
+        // the indirect block is shared with a snapshot or a clone, give this inode its own copy
+        if (write && fs->block_refs[inode->indirect - DATA_FIRST_BLOCK(fs->super.nblocks)] > 1) {
+            block_ptr = indirect_cow(fs, inode->indirect, &h->indirect_block);
+            if (block_ptr == -1) {
+                printf("write_to_inode: failed copying shared indirect block for inode %ld\n", h->inode_num);
+                return BLOCK_STOP;
+            }
+
+            inode->indirect = block_ptr;
+            h->inode_modified = true;
+            h->indirect_modified = true;
+        }
+
+        ptr = &h->indirect_block.pointers[current_block - POINTERS_PER_INODE];
+    }
+
+    if (!*ptr) {
+        if (!write) {
+            return BLOCK_HOLE;
+        }
+
+        block_ptr = block_alloc(fs);
+        if (block_ptr == -1) {
+            printf("write_to_inode: disk is full\n");
+            return BLOCK_STOP;
+        }
+
+        *ptr = block_ptr;
+    } else if (write) {
+        *src = *ptr;
+
+        block_ptr = block_cow(fs, *ptr);
+        if (block_ptr == -1) {
+            printf("write_to_inode: disk is full\n");
+            return BLOCK_STOP;
+        }
+
+        if (block_ptr == *ptr) {
+            return block_ptr;
+        }
+
+        *ptr = block_ptr;
+    } else {
+        return *ptr;
+    }
+
+    if (current_block < POINTERS_PER_INODE) {
+        h->inode_modified = true;
+    } else {
+        h->indirect_modified = true;
+    }
+
+    return *ptr;
+}
+
+// adds the transfer of len bytes at offset off of block to the batch, taking the bytes from / to
+// the caller's buffers at iov[*idx] + *pos. segments are split at buffer boundaries and the
+// buffer cursor is advanced past the transferred bytes.
+static bool batch_add(Batch *batch, uint32_t block, uint32_t src, size_t off, size_t len,
+                      const struct iovec *iov, int *idx, size_t *pos, size_t op, bool write) {
+    while (len > 0) {
+        if (*pos == iov[*idx].iov_len) {
+            (*idx)++;
+            *pos = 0;
+            continue;
+        }
+
+        if (batch->count == batch->cap) {
+            size_t cap = batch->cap ? batch->cap * 2 : 16;
+            Segment *segs = (Segment*)realloc(batch->segs, cap * sizeof(Segment));
+            if (segs == NULL) {
+                printf("fs_submit: failed allocating segments\n");
+                return false;
+            }
+
+            batch->segs = segs;
+            batch->cap = cap;
+        }
+
+        size_t s = iov[*idx].iov_len - *pos < len ? iov[*idx].iov_len - *pos : len;
+
+        Segment *seg = &batch->segs[batch->count];
+        seg->block = block;
+        seg->src = src;
+        seg->off = off;
+        seg->len = s;
+        seg->buff = (char*)iov[*idx].iov_base + *pos;
+        seg->seq = batch->count;
+        seg->op = op;
+        seg->write = write;
+        batch->count++;
+
+        *pos += s;
+        off += s;
+        len -= s;
+    }
+
+    return true;
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t length = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
+    }
+
+    return length;
+}
+
+// splits operation ops[op] on the handle's inode into block segments.
+// sets the operation's result to the number of bytes it will transfer, or -1 on failure.
+//
+// reads stop at the inode's size, and unallocated blocks of a sparse file read as zeros.
+static void resolve_op(FileSystem *fs, Batch *batch, InodeHandle *h, FsOp *ops, size_t op) {
+    FsOp *o = &ops[op];
+    bool write = o->type == FS_OP_WRITE;
+    const char *who = write ? "write_to_inode" : "read_from_inode";
+    size_t first_seg = batch->count;
+    size_t length = iov_length(o->iov, o->iovcnt);
+    size_t offset = o->offset;
+
+    o->result = -1;
+
+    if (!h->loaded) {
+        return;
+    }
+
+    if (!h->inode.valid) {
+        printf("%s: inode %ld is invalid\n", who, h->inode_num);
+        return;
+    }
+
+    if (!write) {
+        if (offset >= h->inode.size) {
+            printf("read_from_inode: inode %ld size is less than the given offset %ld\n", h->inode_num, offset);
+            return;
+        }
+
+        // fix length in case we surpass the inode's size
+        if (offset + length >= h->inode.size) {
+            length = h->inode.size - offset;
+        }
+    }
+
+    if (length == 0) {
+        o->result = 0;
+        return;
+    }
+
+    size_t starting_block = offset / BLOCK_SIZE;
+    size_t ending_block = (offset + length - 1) / BLOCK_SIZE;
+    ssize_t n = 0;
+    int idx = 0;
+    size_t pos = 0;
+
+    for (size_t current_block = starting_block; current_block <= ending_block && length > 0; current_block++) {
+        uint32_t src;
+
+        ssize_t bp = handle_block(fs, h, current_block, write, &src);
+        if (bp == BLOCK_ERROR) {
+            batch->count = first_seg;
+            return;
+        }
+
+        if (bp == BLOCK_STOP) {
+            break;
+        }
+
+        size_t off = current_block == starting_block ? offset % BLOCK_SIZE : 0;
+        size_t s = BLOCK_SIZE - off < length ? BLOCK_SIZE - off : length;
+
+        // unallocated blocks read as zeros, see execute_batch
+
+        if (!batch_add(batch, bp, write ? src : bp, off, s, o->iov, &idx, &pos, op, write)) {
+            batch->count = first_seg;
+            return;
+        }
+
+        n += s;
+        length -= s;
+    }
+
+    // writes extend the file, every block up to offset + n was allocated on the way
+    if (write && n > 0 && offset + n > h->inode.size) {
+        h->inode.size = offset + n;
+        h->inode_modified = true;
+    }
+
+    o->result = n;
+}
+
+static int segment_cmp(const void *a, const void *b) {
+    const Segment *x = (const Segment*)a;
+    const Segment *y = (const Segment*)b;
+
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// all segments of a batch transferring to / from the same disk block.
+typedef struct Group {
+
+    // segments [start, end) of the sorted batch
+    size_t start;
+    size_t end;
+
+    // block the group's initial content is read from, 0 if it needs no read
+    uint32_t src;
+
+    // in-memory copy of the block, NULL when transferring straight from / to the caller's buffer
+    char *buff;
+
+    bool write;
+    bool failed;
+
+} Group;
+
+static int group_src_cmp(const void *a, const void *b) {
+    const Group *x = *(const Group**)a;
+    const Group *y = *(const Group**)b;
+
+    return x->src < y->src ? -1 : x->src > y->src;
+}
+
+// performs the batch's disk I/O. all segments of a block are applied to a single
+// in-memory copy, so each block is read and written at most once. every read is
+// issued before the first write, since a block copied on write is initialized from
+// a block that a later operation in the batch may overwrite in place. reads and
+// writes are each submitted to the disk as one request, so they are spread across
+// the members of a striped disk.
+static void execute_batch(FileSystem *fs, Batch *batch, FsOp *ops) {
+    if (batch->count == 0) {
+        return;
+    }
+
+    qsort(batch->segs, batch->count, sizeof(Segment), segment_cmp);
+
+    Group *groups = (Group*)calloc(batch->count, sizeof(Group));
+    Group **reads = (Group**)malloc(batch->count * sizeof(Group*));
+    DiskIo *ios = (DiskIo*)malloc(batch->count * sizeof(DiskIo));
+    size_t ngroups = 0;
+    size_t nreads = 0;
+
+    if (groups == NULL || reads == NULL || ios == NULL) {
+        goto fail;
+    }
+
+    // holes sort first, they read as zeros and involve no disk block
+    size_t holes = 0;
+
+    for (; holes < batch->count && batch->segs[holes].block == BLOCK_HOLE; holes++) {
+        memset(batch->segs[holes].buff, 0, batch->segs[holes].len);
+    }
+
+    for (size_t i = holes, j; i < batch->count; i = j) {
+        Group *g = &groups[ngroups++];
+        Segment *first = &batch->segs[i];
+
+        for (j = i; j < batch->count && batch->segs[j].block == first->block; j++) {
+            g->write |= batch->segs[j].write;
+        }
+
+        g->start = i;
+        g->end = j;
+
+        bool full = first->off == 0 && first->len == BLOCK_SIZE;
+
+        if (j - i == 1 && full) {
+            // a whole block is transferred straight from / to the caller's buffer
+            g->src = first->write ? 0 : first->block;
+            continue;
+        }
+
+        // the first write replaces the whole block, or the block is new, no need for its previous content.
+        // otherwise perform read-modify-write in cases where we want to update only a part
+        // of a data block. caused by the fact that we only operate with BLOCK_SIZE granularity
+        g->src = full && first->write ? 0 : first->src;
+        if (g->src && g->write) {
+            fs->counters.rmw_writes++;
+        }
+    }
+
+    for (size_t i = 0; i < ngroups; i++) {
+        Group *g = &groups[i];
+        Segment *first = &batch->segs[g->start];
+
+        if (g->end - g->start > 1 || first->off != 0 || first->len != BLOCK_SIZE) {
+            g->buff = disk_buffer_get(fs->disk);
+            if (g->buff == NULL) {
+                goto fail;
+            }
+
+            if (!g->src) {
+                memset(g->buff, 0, BLOCK_SIZE);
+            }
+        }
+
+        if (g->src) {
+            reads[nreads++] = g;
+        }
+    }
+
+    // read the previous content of every block, in order of the blocks it's read from
+    qsort(reads, nreads, sizeof(Group*), group_src_cmp);
+
+    for (size_t i = 0; i < nreads; i++) {
+        Group *g = reads[i];
+
+        ios[i].blocknum = g->src;
+        ios[i].buff = g->buff ? g->buff : batch->segs[g->start].buff;
+        ios[i].write = false;
+    }
+
+    disk_submit(fs->disk, ios, nreads);
+
+    for (size_t i = 0; i < nreads; i++) {
+        reads[i]->failed = !ios[i].ok;
+    }
+
+    // apply the segments in submission order and write the modified blocks
+    size_t nwrites = 0;
+
+    for (size_t i = 0; i < ngroups; i++) {
+        Group *g = &groups[i];
+        Segment *first = &batch->segs[g->start];
+
+        if (g->failed) {
+            continue;
+        }
+
+        if (g->buff) {
+            for (size_t k = g->start; k < g->end; k++) {
+                Segment *seg = &batch->segs[k];
+
+                if (seg->write) {
+                    memcpy(g->buff + seg->off, seg->buff, seg->len);
+                } else {
+                    memcpy(seg->buff, g->buff + seg->off, seg->len);
+                }
+            }
+        }
+
+        if (g->write) {
+            ios[nwrites].blocknum = first->block;
+            ios[nwrites].buff = g->buff ? g->buff : first->buff;
+            ios[nwrites].write = true;
+            reads[nwrites++] = g;
+        }
+    }
+
+    disk_submit(fs->disk, ios, nwrites);
+
+    for (size_t i = 0; i < nwrites; i++) {
+        reads[i]->failed = !ios[i].ok;
+    }
+
+    for (size_t i = 0; i < ngroups; i++) {
+        if (!groups[i].failed) {
+            continue;
+        }
+
+        printf("fs_submit: failed transferring data block %d\n", batch->segs[groups[i].start].block);
+
+        for (size_t k = groups[i].start; k < groups[i].end; k++) {
+            ops[batch->segs[k].op].result = -1;
+        }
+    }
+
+    goto out;
+
+fail:
+    printf("fs_submit: failed allocating block buffers\n");
+
+    for (size_t k = 0; k < batch->count; k++) {
+        ops[batch->segs[k].op].result = -1;
+    }
+
+out:
+    for (size_t i = 0; groups != NULL && i < ngroups; i++) {
+        disk_buffer_put(fs->disk, groups[i].buff);
+    }
+
+    free(ios);
+    free(reads);
+    free(groups);
+}
+
+static int handle_cmp(const void *a, const void *b) {
+    const InodeHandle *x = (const InodeHandle*)a;
+    const InodeHandle *y = (const InodeHandle*)b;
+
+    return x->inode_num < y->inode_num ? -1 : x->inode_num > y->inode_num;
+}
+
+// returns the handle of inode_num in handles, which is sorted by inode number.
+static InodeHandle *find_handle(InodeHandle *handles, size_t count, size_t inode_num) {
+    InodeHandle key;
+    key.inode_num = inode_num;
+
+    return (InodeHandle*)bsearch(&key, handles, count, sizeof(InodeHandle), handle_cmp);
+}
+
+// loads the inodes of all handles, reading every inode block only once into blocks,
+// which has room for every distinct inode block of the handles.
+static void load_handles(FileSystem *fs, InodeHandle *handles, size_t count, union Block *blocks) {
+    union Block *block = NULL;
+    ssize_t current = -1;
+    bool ok = false;
+
+    for (size_t i = 0; i < count; i++) {
+        InodeHandle *h = &handles[i];
+
+        if (h->inode_num >= fs->super.inodes_count) {
+            printf("fs_submit: inode %ld is out of range\n", h->inode_num);
+            continue;
+        }
+
+        if (INODE_BLOCK(h->inode_num) != current) {
+            current = INODE_BLOCK(h->inode_num);
+            block = block == NULL ? blocks : block + 1;
+            ok = read_meta_block(fs, current, block);
+            if (!ok) {
+                printf("load_inode: failed to load inodes block for inode %ld\n", h->inode_num);
+            } else {
+                fs->counters.inode_loads++;
+            }
+        }
+
+        if (ok) {
+            h->inode = block->inodes[INODE_OFFSET_IN_BLOCK(h->inode_num)];
+            h->inode_block = block;
+            h->loaded = true;
+        }
+    }
+}
+
+// writes back modified indirect blocks and inodes, saving every inode block only once.
+// returns false if any handle couldn't be saved, in which case its loaded flag is cleared.
+static bool save_handles(FileSystem *fs, InodeHandle *handles, size_t count) {
+    bool all = true;
+
+    for (size_t i = 0; i < count; i++) {
+        InodeHandle *h = &handles[i];
+
+        // writing modified indirect block back to disk
+        if (h->indirect_modified && !write_meta_block(fs, h->inode.indirect, &h->indirect_block)) {
+            printf("write_to_inode: failed writing indirect block for inode %ld\n", h->inode_num);
+            h->loaded = false;
+            all = false;
+        }
+    }
+
+    for (size_t i = 0, j; i < count; i = j) {
+        size_t current = INODE_BLOCK(handles[i].inode_num);
+        bool modified = false;
+
+        for (j = i; j < count && INODE_BLOCK(handles[j].inode_num) == current; j++) {
+            modified |= handles[j].inode_modified;
+        }
+
+        if (!modified) {
+            continue;
+        }
+
+        // the block loaded by load_handles is still current, nothing but the batch
+        // changes inodes while it runs. modified inodes are only loaded ones
+        union Block *block = handles[i].inode_block;
+
+        for (size_t k = i; k < j; k++) {
+            if (handles[k].inode_modified) {
+                block->inodes[INODE_OFFSET_IN_BLOCK(handles[k].inode_num)] = handles[k].inode;
+            }
+        }
+
+        bool ok = write_meta_block(fs, current, block);
+
+        if (ok) {
+            fs->counters.inode_saves++;
+            continue;
+        }
+
+        for (size_t k = i; k < j; k++) {
+            if (handles[k].inode_modified) {
+                printf("write_to_inode: failed saving inode %ld\n", handles[k].inode_num);
+                handles[k].loaded = false;
+                all = false;
+            }
+        }
+    }
+
+    return all;
+}
+
+bool fs_submit(FileSystem *fs, FsOp *ops, size_t nops) {
+    Batch batch = {0};
+    bool all = true;
+
+    if (nops == 0) {
+        return true;
+    }
+
+    for (size_t i = 0; i < nops; i++) {
+        fs_stats_tick(fs);
+    }
+
+    // one handle per distinct inode, so inode and indirect blocks are loaded once per batch.
+    // a single operation, the common case, keeps its handle and inode block on the stack
+    InodeHandle one_handle;
+    union Block one_block;
+    InodeHandle *handles = nops == 1 ? &one_handle : (InodeHandle*)aligned_alloc(_Alignof(InodeHandle), nops * sizeof(InodeHandle));
+    if (handles == NULL) {
+        printf("fs_submit: failed allocating inode handles\n");
+        return false;
+    }
+
+    memset(handles, 0, nops * sizeof(InodeHandle));
+
+    for (size_t i = 0; i < nops; i++) {
+        handles[i].inode_num = ops[i].inode_num;
+    }
+
+    qsort(handles, nops, sizeof(InodeHandle), handle_cmp);
+
+    size_t nhandles = 0;
+    for (size_t i = 0; i < nops; i++) {
+        if (nhandles == 0 || handles[nhandles - 1].inode_num != handles[i].inode_num) {
+            handles[nhandles++] = handles[i];
+        }
+    }
+
+    // one buffer per distinct inode block, kept until the modified inodes are saved
+    size_t nblocks = 0;
+    for (size_t i = 0; i < nhandles; i++) {
+        nblocks += i == 0 || INODE_BLOCK(handles[i].inode_num) != INODE_BLOCK(handles[i - 1].inode_num);
+    }
+
+    union Block *inode_blocks = nops == 1 ? &one_block : (union Block*)aligned_alloc(sizeof(union Block), nblocks * sizeof(union Block));
+    if (inode_blocks == NULL) {
+        printf("fs_submit: failed allocating inode blocks\n");
+        free(handles);
+        return false;
+    }
+
+    load_handles(fs, handles, nhandles, inode_blocks);
+
+    // operations are resolved in submission order, so later operations see the
+    // blocks allocated and copied by earlier ones
+    for (size_t i = 0; i < nops; i++) {
+        resolve_op(fs, &batch, find_handle(handles, nhandles, ops[i].inode_num), ops, i);
+    }
+
+    execute_batch(fs, &batch, ops);
+
+    if (!save_handles(fs, handles, nhandles)) {
+        for (size_t i = 0; i < nops; i++) {
+            if (!find_handle(handles, nhandles, ops[i].inode_num)->loaded) {
+                ops[i].result = -1;
+            }
         }
+    }
 
-        if (!write_to_disk(fs->disk, bp, b)) {
-            printf("write_to_inode: failed writing data block of inode %ld\n", inode_num);
-            free(inode);
-            return -1;
+    for (size_t i = 0; i < nops; i++) {
+        all &= ops[i].result != -1;
+    }
+
+    free(batch.segs);
+
+    if (handles != &one_handle) {
+        free(inode_blocks);
+        free(handles);
+    }
+
+    return all;
+}
+
+// runs a single operation as a batch of one and returns its result.
+static ssize_t submit_one(FileSystem *fs, FsOpType type, size_t inode_num, const struct iovec *iov, int iovcnt, size_t offset) {
+    FsOp op;
+
+    op.type = type;
+    op.inode_num = inode_num;
+    op.iov = iov;
+    op.iovcnt = iovcnt;
+    op.offset = offset;
+
+    fs_submit(fs, &op, 1);
+
+    return op.result;
+}
+
+ssize_t read_from_inode(FileSystem *fs, size_t inode_num, char *data, size_t length, size_t offset) {
+    struct iovec iov = { .iov_base = data, .iov_len = length };
+
+    return submit_one(fs, FS_OP_READ, inode_num, &iov, 1, offset);
+}
+
+ssize_t write_to_inode(FileSystem *fs, size_t inode_num, char *data, size_t length, size_t offset) {
+    struct iovec iov = { .iov_base = data, .iov_len = length };
+
+    return submit_one(fs, FS_OP_WRITE, inode_num, &iov, 1, offset);
+}
+
+ssize_t readv_inode(FileSystem *fs, size_t inode_num, const struct iovec *iov, int iovcnt, size_t offset) {
+    return submit_one(fs, FS_OP_READ, inode_num, iov, iovcnt, offset);
+}
+
+ssize_t writev_inode(FileSystem *fs, size_t inode_num, const struct iovec *iov, int iovcnt, size_t offset) {
+    return submit_one(fs, FS_OP_WRITE, inode_num, iov, iovcnt, offset);
+}
+
+// drops the references to the blocks behind the indirect pointers from first on, copying the
+// indirect block first if it is shared.
+static bool release_indirect_pointers(FileSystem *fs, Inode *inode, size_t inode_num, size_t first) {
+    union Block indirect_block;
+    bool modified = false;
+
+    if (!read_meta_block(fs, inode->indirect, &indirect_block)) {
+        printf("truncate_inode: failed reading indirect block for inode %ld\n", inode_num);
+        return false;
+    }
+
+    fs->counters.indirect_loads++;
+
+    for (size_t i = first; i < POINTERS_PER_BLOCK; i++) {
+        if (indirect_block.pointers[i] == 0) {
+            continue;
         }
 
-        n += s;
-        length -= s;
-        current_block++;
+        // the indirect block is shared with a snapshot or a clone, give this inode its own copy
+        if (!modified && fs->block_refs[inode->indirect - DATA_FIRST_BLOCK(fs->super.nblocks)] > 1) {
+            ssize_t block_ptr = indirect_cow(fs, inode->indirect, &indirect_block);
+            if (block_ptr == -1) {
+                printf("truncate_inode: failed copying shared indirect block for inode %ld\n", inode_num);
+                return false;
+            }
+
+            inode->indirect = block_ptr;
+        }
+
+        if (!block_dealloc(fs, indirect_block.pointers[i])) {
+            printf("truncate_inode: failed cleaning block %d for inode %ld\n", indirect_block.pointers[i], inode_num);
+            return false;
+        }
+
+        indirect_block.pointers[i] = 0;
+        modified = true;
+    }
+
+    if (modified && !write_meta_block(fs, inode->indirect, &indirect_block)) {
+        printf("truncate_inode: failed writing indirect block for inode %ld\n", inode_num);
+        return false;
+    }
+
+    return true;
+}
+
+bool truncate_inode(FileSystem *fs, size_t inode_num, size_t size) {
+    union Block block;
+
+    fs_stats_tick(fs);
+
+    if (inode_num >= fs->super.inodes_count || fs->free_inodes[inode_num] || size > MAX_INODE_SIZE) {
+        printf("truncate_inode: can't truncate inode %ld to %ld bytes\n", inode_num, size);
+        return false;
+    }
+
+    Inode *inode = load_inode(fs, inode_num, &block);
+    if (inode == NULL) {
+        printf("truncate_inode: failed loading inode %ld\n", inode_num);
+        return false;
+    }
+
+    size_t keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t tail = size % BLOCK_SIZE;
+
+    // zero the rest of the new last block, so the bytes past the new size read as zeros if the
+    // file is extended again. a hole already reads as zeros and is left unallocated. the write
+    // copies the block if it is shared, so reload the inode after it
+    uint32_t last = 0;
+    if (size < inode->size && tail != 0 && map_inode_blocks(fs, inode_num, keep - 1, 1, &last) != 1) {
+        printf("truncate_inode: failed mapping the last block of inode %ld\n", inode_num);
+        free(inode);
+        return false;
+    }
+
+    if (last != 0) {
+        char zeros[BLOCK_SIZE] = {0};
+        struct iovec iov = {zeros, BLOCK_SIZE - tail};
+        FsOp op = {.type = FS_OP_WRITE, .inode_num = inode_num, .iov = &iov, .iovcnt = 1, .offset = size};
+
+        free(inode);
+
+        if (!fs_submit(fs, &op, 1) || (inode = load_inode(fs, inode_num, &block)) == NULL) {
+            printf("truncate_inode: failed zeroing the tail of inode %ld\n", inode_num);
+            return false;
+        }
     }
 
-    // writing modified indirect block back to disk
-    if (indirect_modified && inode->indirect > 0 && !write_to_disk(fs->disk, inode->indirect, indirect_block.data)) {
-        printf("write_to_inode: failed writing indirect block for inode %ld\n", inode_num);
+    bool ok = true;
+
+    if (size < inode->size) {
+        if (keep <= POINTERS_PER_INODE) {
+            ok = release_inode_blocks_from(fs, inode, inode_num, keep);
+        } else if (inode->indirect != 0) {
+            ok = release_indirect_pointers(fs, inode, inode_num, keep - POINTERS_PER_INODE);
+        }
+    }
+
+    // growing only moves the size, the new range is a hole that reads as zeros
+    inode->size = size;
+
+    if (!ok || !save_inode(fs, inode, inode_num, &block)) {
+        printf("truncate_inode: failed truncating inode %ld\n", inode_num);
         free(inode);
+        return false;
+    }
+
+    free(inode);
+
+    return true;
+}
+
+ssize_t map_inode_blocks(FileSystem *fs, size_t inode_num, size_t first_block, size_t count, uint32_t *blocks) {
+    union Block block;
+
+    Inode *inode = load_inode(fs, inode_num, &block);
+    if (inode == NULL) {
+        printf("map_inode_blocks: failed loading inode %ld\n", inode_num);
         return -1;
     }
 
-    // write modified inode back to disk
-    if (inode_modified && !save_inode(fs, inode, inode_num, &inode_block)) {
-        printf("write_to_inode: failed saving inode %ld\n", inode_num);
+    if (!inode->valid) {
         free(inode);
         return -1;
     }
 
+    bool loaded = false;
+    size_t n = 0;
+
+    for (; n < count; n++) {
+        size_t current_block = first_block + n;
+
+        if (current_block < POINTERS_PER_INODE) {
+            blocks[n] = inode->direct[current_block];
+            continue;
+        }
+
+        if (current_block - POINTERS_PER_INODE >= POINTERS_PER_BLOCK) {
+            break;
+        }
+
+        if (!inode->indirect) {
+            blocks[n] = 0;
+            continue;
+        }
+
+        if (!loaded) {
+            // reuse the inode block buffer, the inode itself was already copied out
+            if (!read_meta_block(fs, inode->indirect, &block)) {
+                printf("map_inode_blocks: failed reading indirect block for inode %ld\n", inode_num);
+                free(inode);
+                return -1;
+            }
+
+            fs->counters.indirect_loads++;
+            loaded = true;
+        }
+
+        blocks[n] = block.pointers[current_block - POINTERS_PER_INODE];
+    }
+
     free(inode);
 
     return n;
 }
+
+// persists the in-memory super block.
+static bool save_super(FileSystem *fs) {
+    union Block block;
+
+    memset(block.data, 0, BLOCK_SIZE);
+    block.super = fs->super;
+
+    if (!write_meta_block(fs, SUPER_BLOCK_NUMBER, &block)) {
+        printf("save_super: failed writing super block to disk\n");
+        return false;
+    }
+
+    return true;
+}
+
+// drops the references the inodes of a snapshot's first count inode block copies hold, and frees
+// the copies. a failed snapshot_create passes the number of copies it fully referenced, since the
+// copy that failed has its partial references rolled back by ref_inodes_block.
+static bool release_snapshot_blocks(FileSystem *fs, SnapshotDescs *descs, int count) {
+    union Block block;
+
+    for (int i = 0; i < count; i++) {
+        uint32_t copy = *snapshot_copy(descs, i);
+
+        if (!read_meta_block(fs, copy, &block)) {
+            printf("snapshot_delete: failed reading snapshot inodes block %d\n", copy);
+            return false;
+        }
+
+        for (int j = 0; j < INODES_PER_BLOCK; j++) {
+            if (!release_inode_blocks(fs, &block.inodes[j], i * INODES_PER_BLOCK + j)) {
+                return false;
+            }
+        }
+
+        if (!block_dealloc(fs, copy)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// frees a snapshot's descriptor blocks.
+static bool release_snapshot_descs(FileSystem *fs, SnapshotDescs *descs) {
+    bool ok = true;
+
+    for (int k = 0; k < descs->count; k++) {
+        if (descs->ptrs[k] != 0) {
+            ok &= block_dealloc(fs, descs->ptrs[k]);
+        }
+    }
+
+    return ok;
+}
+
+ssize_t clone_inode(FileSystem *fs, size_t inode_num) {
+    union Block src_block;
+    union Block dst_block;
+
+    fs_stats_tick(fs);
+
+    if (inode_num >= fs->super.inodes_count || fs->free_inodes[inode_num]) {
+        printf("clone_inode: inode %ld is invalid\n", inode_num);
+        return -1;
+    }
+
+    ssize_t clone_num = -1;
+    for (int i = 0; i < fs->super.inodes_count; i++) {
+        if (fs->free_inodes[i]) {
+            clone_num = i;
+            break;
+        }
+    }
+
+    if (clone_num == -1) {
+        printf("clone_inode: no free inodes\n");
+        return -1;
+    }
+
+    Inode *src = load_inode(fs, inode_num, &src_block);
+    if (src == NULL) {
+        printf("clone_inode: failed loading inode %ld\n", inode_num);
+        return -1;
+    }
+
+    Inode *clone = load_inode(fs, clone_num, &dst_block);
+    if (clone == NULL) {
+        printf("clone_inode: failed loading inode %ld\n", clone_num);
+        free(src);
+        return -1;
+    }
+
+    // the clone points to the same blocks, which gain a reference each
+    if (!ref_inode_blocks(fs, src)) {
+        printf("clone_inode: failed referencing blocks of inode %ld\n", inode_num);
+        free(src);
+        free(clone);
+        return -1;
+    }
+
+    *clone = *src;
+
+    if (!save_inode(fs, clone, clone_num, &dst_block)) {
+        printf("clone_inode: failed saving inode %ld\n", clone_num);
+        release_inode_blocks(fs, src, inode_num);
+        free(src);
+        free(clone);
+        return -1;
+    }
+
+    fs->free_inodes[clone_num] = false;
+
+    free(src);
+    free(clone);
+
+    return clone_num;
+}
+
+ssize_t snapshot_create(FileSystem *fs) {
+    SnapshotDescs descs;
+    union Block block;
+    int slot = -1;
+
+    fs_stats_tick(fs);
+
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (fs->super.snapshots[i] == 0) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == -1) {
+        printf("snapshot_create: no free snapshot slots\n");
+        return -1;
+    }
+
+    if (!snapshot_descs_alloc(fs, &descs)) {
+        return -1;
+    }
+
+    // allocate the chain of descriptor blocks, each linking to the next
+    for (int k = 0; k < descs.count; k++) {
+        ssize_t desc_ptr = block_alloc(fs);
+        if (desc_ptr == -1) {
+            printf("snapshot_create: disk is full\n");
+            release_snapshot_descs(fs, &descs);
+            snapshot_descs_free(&descs);
+            return -1;
+        }
+
+        descs.ptrs[k] = desc_ptr;
+
+        if (k > 0) {
+            descs.blocks[k - 1].pointers[SNAPSHOT_DESC_NEXT] = desc_ptr;
+        }
+    }
+
+    // copy every inode block, the blocks its inodes point to are shared with the live tree
+    for (int i = 0; i < fs->super.inblocks; i++) {
+        ssize_t block_ptr = block_alloc(fs);
+        bool ok = block_ptr != -1;
+
+        if (ok) {
+            *snapshot_copy(&descs, i) = block_ptr;
+
+            // the checksum covers the content only, so the verified block is copied as is.
+            // a failed ref_inodes_block rolls back the references it took
+            ok = read_meta_block(fs, INODES_FIRST_BLOCK + i, &block) &&
+                 write_to_disk(fs->disk, block_ptr, block.data) &&
+                 ref_inodes_block(fs, &block);
+
+            if (!ok) {
+                block_dealloc(fs, block_ptr);
+            }
+        }
+
+        if (!ok) {
+            printf("snapshot_create: failed copying inodes block %d\n", i);
+            release_snapshot_blocks(fs, &descs, i);
+            release_snapshot_descs(fs, &descs);
+            snapshot_descs_free(&descs);
+            return -1;
+        }
+    }
+
+    bool ok = true;
+
+    for (int k = 0; ok && k < descs.count; k++) {
+        ok = write_meta_block(fs, descs.ptrs[k], &descs.blocks[k]);
+    }
+
+    if (!ok) {
+        printf("snapshot_create: failed writing snapshot descriptor\n");
+    } else {
+        fs->super.snapshots[slot] = descs.ptrs[0];
+
+        ok = save_super(fs);
+        if (!ok) {
+            fs->super.snapshots[slot] = 0;
+        }
+    }
+
+    if (!ok) {
+        release_snapshot_blocks(fs, &descs, fs->super.inblocks);
+        release_snapshot_descs(fs, &descs);
+        snapshot_descs_free(&descs);
+        return -1;
+    }
+
+    snapshot_descs_free(&descs);
+
+    return slot;
+}
+
+bool snapshot_delete(FileSystem *fs, size_t snap_id) {
+    SnapshotDescs descs;
+
+    fs_stats_tick(fs);
+
+    if (snap_id >= MAX_SNAPSHOTS || fs->super.snapshots[snap_id] == 0) {
+        printf("snapshot_delete: snapshot %ld does not exist\n", snap_id);
+        return false;
+    }
+
+    uint32_t head = fs->super.snapshots[snap_id];
+
+    if (!snapshot_descs_load(fs, head, &descs)) {
+        printf("snapshot_delete: failed reading snapshot descriptor\n");
+        return false;
+    }
+
+    // forget the snapshot first, so a failure below leaks blocks instead of leaving a broken snapshot
+    fs->super.snapshots[snap_id] = 0;
+
+    if (!save_super(fs)) {
+        fs->super.snapshots[snap_id] = head;
+        snapshot_descs_free(&descs);
+        return false;
+    }
+
+    bool ok = release_snapshot_blocks(fs, &descs, fs->super.inblocks) && release_snapshot_descs(fs, &descs);
+
+    snapshot_descs_free(&descs);
+
+    return ok;
+}
+
+ssize_t read_from_snapshot(FileSystem *fs, size_t snap_id, size_t inode_num, char *data, size_t length, size_t offset) {
+    union Block block;
+
+    fs_stats_tick(fs);
+
+    if (snap_id >= MAX_SNAPSHOTS || fs->super.snapshots[snap_id] == 0) {
+        printf("read_from_snapshot: snapshot %ld does not exist\n", snap_id);
+        return -1;
+    }
+
+    if (inode_num >= fs->super.inodes_count) {
+        printf("read_from_snapshot: inode %ld is out of range\n", inode_num);
+        return -1;
+    }
+
+    // follow the descriptor chain to the descriptor holding the inode's block
+    size_t inode_block = inode_num / INODES_PER_BLOCK;
+    uint32_t desc_ptr = fs->super.snapshots[snap_id];
+
+    for (size_t k = 0; k <= inode_block / SNAPSHOT_DESC_POINTERS; k++) {
+        if (desc_ptr == 0 || !read_meta_block(fs, desc_ptr, &block)) {
+            printf("read_from_snapshot: failed reading snapshot descriptor\n");
+            return -1;
+        }
+
+        desc_ptr = block.pointers[SNAPSHOT_DESC_NEXT];
+    }
+
+    if (!read_meta_block(fs, block.pointers[inode_block % SNAPSHOT_DESC_POINTERS], &block)) {
+        printf("read_from_snapshot: failed loading inodes block for inode %ld\n", inode_num);
+        return -1;
+    }
+
+    fs->counters.inode_loads++;
+
+    // resolve the read against the snapshot's copy of the inode, its blocks are never written
+    InodeHandle h = {0};
+    Batch batch = {0};
+    struct iovec iov = { .iov_base = data, .iov_len = length };
+    FsOp op = { .type = FS_OP_READ, .inode_num = inode_num, .iov = &iov, .iovcnt = 1, .offset = offset };
+
+    h.inode_num = inode_num;
+    h.inode = block.inodes[INODE_OFFSET_IN_BLOCK(inode_num)];
+    h.loaded = true;
+
+    resolve_op(fs, &batch, &h, &op, 0);
+    execute_batch(fs, &batch, &op);
+
+    free(batch.segs);
+
+    return op.result;
+}
\ No newline at end of file
@@ -1,20 +1,32 @@
 #include "disk.h"
 
 #include <stdint.h>
+#include <sys/uio.h>
 
-#define MAGIC_NUMBER 0xf0f03410
-#define INODES_PER_BLOCK (BLOCK_SIZE / 32)
+#define MAGIC_NUMBER 0xf0f03411
+// the last 4 bytes of every metadata block (super, inode, indirect and snapshot blocks) hold its CRC32C
+#define BLOCK_CHECKSUM_SIZE 4
+#define INODES_PER_BLOCK ((BLOCK_SIZE - BLOCK_CHECKSUM_SIZE) / 32)
 #define POINTERS_PER_INODE 5
-#define POINTERS_PER_BLOCK (BLOCK_SIZE / 4)
-#define NUMBER_OF_INODE_BLOCKS(nblocks) 0.1 * nblocks
-#define NUMBER_OF_DATA_BLOCKS(nblocks) nblocks - NUMBER_OF_INODE_BLOCKS(nblocks) - 1 // superblock
+#define POINTERS_PER_BLOCK ((BLOCK_SIZE - BLOCK_CHECKSUM_SIZE) / 4)
+#define NUMBER_OF_INODE_BLOCKS(nblocks) ((nblocks) / 10)
+#define NUMBER_OF_DATA_BLOCKS(nblocks) ((nblocks) - NUMBER_OF_INODE_BLOCKS(nblocks) - 1) // superblock
 #define SUPER_BLOCK_NUMBER 0
 #define INODES_FIRST_BLOCK 1
-#define DATA_FIRST_BLOCK(nblocks) INODES_FIRST_BLOCK + NUMBER_OF_INODE_BLOCKS(nblocks)
+#define DATA_FIRST_BLOCK(nblocks) (INODES_FIRST_BLOCK + NUMBER_OF_INODE_BLOCKS(nblocks))
 #define SUPER_BLOCK_OFFSET BLOCK_OFFSET(SUPER_BLOCK_NUMBER)
 #define INODE_BLOCKS_OFFSET BLOCK_OFFSET(INODES_FIRST_BLOCK)
 #define INODE_BLOCK(inode_num) INODES_FIRST_BLOCK + inode_num / INODES_PER_BLOCK
 #define INODE_OFFSET_IN_BLOCK(inode_num) inode_num % INODES_PER_BLOCK
+#define MAX_SNAPSHOTS 16
+// a snapshot descriptor block holds pointers to copies of inode blocks, and its last pointer
+// links the next descriptor block, so a snapshot can cover any number of inode blocks
+#define SNAPSHOT_DESC_POINTERS (POINTERS_PER_BLOCK - 1)
+#define SNAPSHOT_DESC_NEXT SNAPSHOT_DESC_POINTERS
+#define MAX_BLOCK_REFS UINT16_MAX
+#define MAX_INODE_SIZE ((size_t)(POINTERS_PER_INODE + POINTERS_PER_BLOCK) * BLOCK_SIZE)
+// number of inode blocks read with a single request when scanning the inode table
+#define INODE_SCAN_BLOCKS 32
 
 typedef struct SuperBlock {
 
@@ -30,21 +42,77 @@ typedef struct SuperBlock {
     // total number of inodes
     uint32_t inodes_count;
 
+    // first snapshot descriptor blocks, 0 for an unused slot. a chain of descriptor
+    // blocks holds pointers to the snapshot's private copy of the inode blocks.
+    uint32_t snapshots[MAX_SNAPSHOTS];
+
 } SuperBlock;
 
+typedef struct FsCounters {
+
+    // number of public filesystem operations performed
+    uint64_t ops;
+
+    // number of successful / failed block allocations
+    uint64_t block_allocs;
+    uint64_t alloc_failures;
+
+    // number of bitmap entries scanned per block allocation
+    Histogram alloc_scan;
+
+    // number of blocks returned to the free blocks pool
+    uint64_t block_deallocs;
+
+    // number of inode blocks loaded / saved for a single inode
+    uint64_t inode_loads;
+    uint64_t inode_saves;
+
+    // number of indirect blocks read from disk
+    uint64_t indirect_loads;
+
+    // number of partial block writes that required a read-modify-write
+    uint64_t rmw_writes;
+
+    // number of metadata blocks whose checksum didn't match their content
+    uint64_t checksum_errors;
+
+    // number of inode blocks streamed by inode table scans
+    uint64_t inode_scan_blocks;
+
+} FsCounters;
+
+typedef struct FsStats {
+
+    // block I/O performed on the underlying disk
+    IoStats io;
+
+    // filesystem level counters
+    FsCounters fs;
+
+} FsStats;
+
 typedef struct FileSystem {
 
     // bitmap for indicating which inodes are not used on disk
     char *free_inodes;
 
-    // bitmap for free blocks
-    char *free_blocks; 
+    // reference count of every data block, 0 means the block is free.
+    // a block is referenced once by every inode or indirect block pointing to it,
+    // so blocks shared between the live tree, snapshots and clones have count > 1.
+    uint16_t *block_refs;
 
     Disk *disk;
 
     // filesystem's super block
     struct SuperBlock super;
 
+    // hot path counters, see fs_get_stats
+    FsCounters counters;
+
+    // when set, stats are dumped to stats_out every stats_every operations
+    FILE *stats_out;
+    uint64_t stats_every;
+
 } FileSystem;
 
 // formats a new filesystem on the given disk.
@@ -56,18 +124,31 @@ FileSystem *mount_fs(Disk* disk);
 // allocates a new block on disk and returns a pointer to it.
 ssize_t block_alloc(FileSystem *fs);
 
-// deallocates block with the given block_num and returns it to the free blocks pool.
+// takes another reference to block block_num. fails if its reference count would overflow.
+bool block_ref(FileSystem *fs, int block_num);
+
+// drops a reference to block block_num. once the last reference is dropped
+// the block is cleaned and returned to the free blocks pool.
 bool block_dealloc(FileSystem *fs, int block_num);
 
 // frees the given filesystem and its resources.
 void free_fs(FileSystem *fs);
 
+// copies a snapshot of the filesystem's and its disk's counters into stats.
+void fs_get_stats(FileSystem *fs, FsStats *stats);
+
+// prints the filesystem's counters and histograms to out.
+void fs_dump_stats(FileSystem *fs, FILE *out);
+
+// dumps stats to out every `every` filesystem operations. every = 0 disables periodic dumps.
+void fs_set_stats_dump(FileSystem *fs, FILE *out, uint64_t every);
+
 typedef struct Inode {
 
     // whether or not the inode is valid
     uint32_t valid;
 
-    // size of the file
+    // size of the file in bytes
     uint32_t size;
 
     // array of direct pointers to inode's data blocks
@@ -83,31 +164,129 @@ union Block {
     Inode inodes[INODES_PER_BLOCK];
     uint32_t pointers[POINTERS_PER_BLOCK]; 
     char data[BLOCK_SIZE];
-} Block;
+    struct {
+        char payload[BLOCK_SIZE - BLOCK_CHECKSUM_SIZE];
+        uint32_t checksum;
+    } meta;
+} __attribute__((aligned(BUFPOOL_ALIGN))); // so blocks can be used for O_DIRECT I/O without bouncing
+
+// computes the checksum of a metadata block and stores it at the end of the block.
+void block_seal(union Block *block);
+
+// returns whether the checksum stored in a metadata block matches its content.
+bool block_verify(union Block *block);
 
 // creats a new inode in the file system and returns its pointer.
 ssize_t create_inode(FileSystem *fs);
 
+// creates inode inode_num if it is free. used by frontends that name files by inode number.
+bool create_inode_at(FileSystem *fs, size_t inode_num);
+
 // free inode with the given inode_num index.
 bool remove_inode(FileSystem *fs, size_t inode_num);
 
-// returns the logical size in bytes of the given inode_num.
-// for simplicity the file's size is not fully accurate and is calculated by
-// inode's total allocated blocks * BLOCK_SIZE.
+// returns the size in bytes of the given inode_num, the end of the furthest write or truncate.
 ssize_t stat_inode(FileSystem *fs, size_t inode_num);
 
+// sets the size of inode inode_num. shrinking frees the blocks past the new size,
+// growing leaves a hole that reads as zeros.
+bool truncate_inode(FileSystem *fs, size_t inode_num, size_t size);
+
+// a run of consecutive inodes handed out by for_each_inode.
+typedef struct InodeBatch {
+
+    // number of the first inode in the batch
+    size_t first_inode;
+
+    // number of inodes in the batch
+    size_t count;
+
+    // the inodes' records, only valid until the callback returns
+    const Inode *inodes;
+
+} InodeBatch;
+
+// called by for_each_inode with every batch of inodes. returning false stops the iteration.
+typedef bool (*InodeBatchFn)(const InodeBatch *batch, void *arg);
+
+// calls fn with every inode in the filesystem, valid or not, in batches of one inode block.
+// the inode table is streamed with large sequential reads while the next reads are prefetched.
+// with nthreads > 1 the table is split between nthreads threads calling fn concurrently, in
+// which case fn must be thread safe. the filesystem must not be modified during the iteration.
+// returns true if every inode was visited.
+bool for_each_inode(FileSystem *fs, InodeBatchFn fn, void *arg, int nthreads);
+
+// fills sizes with the sizes of the count inodes starting at first_inode, or -1 for invalid inodes.
+// reads each inode block once instead of once per inode like stat_inode. returns the number of
+// entries filled, which is less than count if the range runs past the last inode, or -1 on failure.
+ssize_t bulk_stat(FileSystem *fs, size_t first_inode, size_t count, ssize_t *sizes);
+
 // loads inode into memory.
 Inode* load_inode(FileSystem *fs, size_t inode_num, union Block *block);
 
 // save inode to to disk.
 bool save_inode(FileSystem *fs, Inode *inode, size_t inode_num, union Block *block);
 
-// reads length bytes starting at offset from inode inode_num into data buffer.
-// it's possible that the inode's data blocks are fragmanted, in that case the data buffer
-// will contain the concatenated content. this approach may be incorrect since this unallocated blocks
-// are gaps of zeros that should be part of the file as well.
+// reads length bytes starting at offset from inode inode_num into data buffer, stopping at the inode's size.
+// unallocated blocks of a sparse file read as zeros.
 ssize_t read_from_inode(FileSystem *fs, size_t inode_num, char *data, size_t length, size_t offset);
 
 // writes length bytes from data buffer to inode inode_num starting at the given offset.
 ssize_t write_to_inode(FileSystem *fs, size_t inode_num, char *data, size_t length, size_t offset);
 
+// reads starting at offset from inode inode_num into the iovcnt buffers of iov, filling them in order.
+// behaves like read_from_inode reading the buffers' total length into one buffer.
+ssize_t readv_inode(FileSystem *fs, size_t inode_num, const struct iovec *iov, int iovcnt, size_t offset);
+
+// writes the iovcnt buffers of iov, in order, to inode inode_num starting at offset.
+ssize_t writev_inode(FileSystem *fs, size_t inode_num, const struct iovec *iov, int iovcnt, size_t offset);
+
+typedef enum FsOpType {
+    FS_OP_READ,
+    FS_OP_WRITE,
+} FsOpType;
+
+typedef struct FsOp {
+
+    FsOpType type;
+
+    size_t inode_num;
+
+    // buffers to read into / write from, in order
+    const struct iovec *iov;
+    int iovcnt;
+
+    // offset in the inode to start at
+    size_t offset;
+
+    // set by fs_submit to the number of bytes transferred, or -1 if the operation failed
+    ssize_t result;
+
+} FsOp;
+
+// runs nops read and write operations, on any inodes, as one batch. operations take effect in
+// the order given, but every inode and indirect block is loaded and saved once for the whole batch,
+// and data blocks are read and written once each, with all reads and then all writes submitted to
+// the disk together.
+// returns true if all operations succeeded, see each operation's result otherwise.
+bool fs_submit(FileSystem *fs, FsOp *ops, size_t nops);
+
+// creates a new inode sharing all of inode_num's blocks and returns its number.
+// blocks are copied lazily by write_to_inode once either inode modifies them.
+ssize_t clone_inode(FileSystem *fs, size_t inode_num);
+
+// takes a point-in-time snapshot of all inodes and returns its id.
+// only the inode blocks are copied, data and indirect blocks are shared with the live tree.
+ssize_t snapshot_create(FileSystem *fs);
+
+// deletes snapshot snap_id and drops its references to shared blocks.
+bool snapshot_delete(FileSystem *fs, size_t snap_id);
+
+// reads length bytes starting at offset from inode inode_num as it was when snapshot snap_id was taken.
+ssize_t read_from_snapshot(FileSystem *fs, size_t snap_id, size_t inode_num, char *data, size_t length, size_t offset);
+
+// resolves count logical blocks of inode inode_num starting at first_block into disk block numbers.
+// unallocated blocks are reported as 0. returns the number of entries filled in blocks, which may be
+// less than count when the range runs past the last addressable block, or -1 on failure.
+ssize_t map_inode_blocks(FileSystem *fs, size_t inode_num, size_t first_block, size_t count, uint32_t *blocks);
+
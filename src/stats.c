@@ -0,0 +1,47 @@
+#include "stats.h"
+
+void histogram_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+void io_stats_merge(IoStats *into, const IoStats *from) {
+    into->reads += from->reads;
+    into->writes += from->writes;
+    into->read_errors += from->read_errors;
+    into->write_errors += from->write_errors;
+    into->bounces += from->bounces;
+    into->pool_overflows += from->pool_overflows;
+
+    histogram_merge(&into->read_latency, &from->read_latency);
+    histogram_merge(&into->write_latency, &from->write_latency);
+}
+
+void histogram_dump(const Histogram *h, const char *name, const char *unit, FILE *out) {
+    if (h->count == 0) {
+        fprintf(out, "  %s: no samples\n", name);
+        return;
+    }
+
+    fprintf(out, "  %s: count=%llu mean=%llu%s max=%llu%s\n", name,
+            (unsigned long long)h->count,
+            (unsigned long long)(h->sum / h->count), unit,
+            (unsigned long long)h->max, unit);
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (h->buckets[i] == 0) {
+            continue;
+        }
+
+        fprintf(out, "    [%llu, %llu)%s: %llu\n",
+                i == 0 ? 0ull : 1ull << i, 1ull << (i + 1), unit,
+                (unsigned long long)h->buckets[i]);
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef SIMPLEFS_STATS_H
+#define SIMPLEFS_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// number of power-of-two buckets in a histogram.
+// bucket i counts samples in the range [2^i, 2^(i+1)).
+#define HISTOGRAM_BUCKETS 40
+
+typedef struct Histogram {
+
+    // number of samples per power-of-two bucket
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+
+    // total number of samples recorded
+    uint64_t count;
+
+    // sum of all samples, used for computing the mean
+    uint64_t sum;
+
+    // largest sample recorded
+    uint64_t max;
+
+} Histogram;
+
+typedef struct IoStats {
+
+    // number of blocks read from / written to the disk
+    uint64_t reads;
+    uint64_t writes;
+
+    // number of failed block reads / writes
+    uint64_t read_errors;
+    uint64_t write_errors;
+
+    // number of blocks copied through an aligned buffer for O_DIRECT
+    uint64_t bounces;
+
+    // number of block buffers allocated from the heap because the buffer pool was empty
+    uint64_t pool_overflows;
+
+    // latency in nanoseconds of single block reads / writes
+    Histogram read_latency;
+    Histogram write_latency;
+
+} IoStats;
+
+// counters are plain integers updated without locks or atomics, so the hot path
+// stays a couple of adds per operation. a filesystem's and its disk's counters
+// must only be touched by the thread owning the filesystem, serialized by its
+// caller. the threads of a parallel inode scan never touch them: each counts
+// its I/O in its own IoStats, passed to disk_submit_with, and its scan counters
+// in its InodeScan, and both are merged into the shared counters (through
+// io_stats_merge for IoStats) by the owning thread once the threads are joined.
+static inline void histogram_record(Histogram *h, uint64_t value) {
+    int bucket = value ? 63 - __builtin_clzll(value) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+
+    h->buckets[bucket]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+// returns a monotonic timestamp in nanoseconds.
+static inline uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// adds the samples of from to into.
+void histogram_merge(Histogram *into, const Histogram *from);
+
+// adds the counters of from to into, for merging counters kept apart by several threads.
+void io_stats_merge(IoStats *into, const IoStats *from);
+
+// prints the non-empty buckets of the given histogram to out.
+void histogram_dump(const Histogram *h, const char *name, const char *unit, FILE *out);
+
+#endif